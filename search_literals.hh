@@ -0,0 +1,250 @@
+#ifndef SEARCH_LITERALS_HH
+#define SEARCH_LITERALS_HH
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static char ascii_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+}
+
+static bool ascii_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// the last character of a delimited escape operand, or of the pattern if it is unterminated
+static const char *skip_until(const char *p, char close) {
+    const char *end = strchr(p, close);
+    return end ? end : p + strlen(p) - 1;
+}
+
+// Skip the operand of the escape letter at p, returning a pointer to its last character.
+static const char *skip_escape(const char *p) {
+    switch (*p) {
+        case 'x':
+            if (p[1] == '{') return skip_until(p + 1, '}');
+            for (int i = 0; i < 2 && strchr("0123456789abcdefABCDEF", p[1]) && p[1]; i++) p++;
+            return p;
+        case 'o':
+        case 'N':
+        case 'p':
+        case 'P':
+            if (p[1] == '{') return skip_until(p + 1, '}');
+            return (*p == 'p' || *p == 'P') && p[1] ? p + 1 : p;
+        case 'c':
+            return p[1] ? p + 1 : p;
+        case 'k':
+        case 'g':
+            if (p[1] == '{') return skip_until(p + 1, '}');
+            if (p[1] == '<') return skip_until(p + 1, '>');
+            if (p[1] == '\'') return skip_until(p + 2, '\'');
+            if (*p == 'g' && (p[1] == '-' || p[1] == '+')) p++;
+            while (ascii_digit(p[1])) p++;
+            return p;
+        default:
+            if (ascii_digit(*p)) {
+                for (int i = 0; i < 2 && ascii_digit(p[1]); i++) p++;
+            }
+            return p;
+    }
+}
+
+// Upper bound on the characters matched by the body of a group, or 0 if it has repeats or
+// backreferences. Every other pattern character matches at most two.
+static size_t group_bound(const char *begin, const char *end) {
+    for (const char *p = begin; p < end; p++) {
+        if (*p == '*' || *p == '+' || *p == '{') {
+            return 0;
+        }
+        if (*p == '\\' && p + 1 < end && (ascii_digit(p[1]) || strchr("gkQX", p[1]))) {
+            return 0;
+        }
+    }
+    return (size_t)(end - begin) * 2;
+}
+
+// Collect literal runs of at least three characters, lowercased, that every match must
+// contain within max_offset characters of its start. Literals after a repeat without an upper
+// bound are not collected, as they may be arbitrarily far from the start. Returns false if
+// nothing can be required, as with a top-level alternation.
+static bool required_literals(const char *pattern, size_t max_offset,
+                              std::vector<std::string> *literals) {
+    std::string run;
+    size_t offset = 0; // characters a match may have before the current position
+    size_t last = 0;   // characters the previous element may match
+    auto flush = [&] {
+        if (run.size() >= 3) {
+            literals->push_back(run);
+        }
+        run.clear();
+    };
+    auto advance = [&](size_t n) {
+        last = n;
+        offset += n;
+        return offset <= max_offset;
+    };
+    auto literal = [&](char c) {
+        if (!advance(1)) {
+            flush();
+            return false;
+        }
+        if ((unsigned char)c < 0x80) {
+            run.push_back(ascii_lower(c));
+        } else {
+            flush(); // caseless matching of non-ascii is left to the regex
+        }
+        return true;
+    };
+    // skip a group or character class, returning a pointer to its closing character
+    auto skip = [](const char *p) {
+        int depth = 0;
+        for (; *p; p++) {
+            if (*p == '\\') {
+                if (!*++p) break;
+            } else if (*p == '[') {
+                p++;
+                if (*p == '^') p++;
+                if (*p == ']') p++;
+                while (*p && *p != ']') {
+                    if (*p == '[' && p[1] == ':' && strstr(p, ":]")) {
+                        p = strstr(p, ":]") + 1;
+                    } else if (*p == '\\' && p[1]) {
+                        p++;
+                    }
+                    p++;
+                }
+                if (!*p || depth == 0) break;
+            } else if (*p == '(') {
+                depth++;
+            } else if (*p == ')' && --depth == 0) {
+                break;
+            }
+        }
+        return p;
+    };
+    // a following lazy or possessive modifier belongs to the quantifier
+    auto skip_modifier = [](const char *p) {
+        return p[1] == '?' || p[1] == '+' ? p + 1 : p;
+    };
+
+    for (const char *p = pattern; *p; p++) {
+        const char c = *p;
+        switch (c) {
+            case '|':
+                return false;
+            case '(': {
+                bool zero_width = false;
+                if (p[1] == '?') {
+                    for (const char *q = p + 2; *q == '-' || (ascii_lower(*q) >= 'a' &&
+                                                              ascii_lower(*q) <= 'z'); q++) {
+                        if (*q == 'x') return false; // extended syntax ignores whitespace
+                    }
+                    zero_width = (p[2] && strchr("#=!", p[2])) ||
+                                 (p[2] == '<' && (p[3] == '=' || p[3] == '!'));
+                }
+                flush();
+                const char *close = skip(p);
+                if (!*close) {
+                    return true;
+                }
+                const size_t bound = zero_width ? 0 : group_bound(p + 1, close);
+                if (!zero_width && (!bound || !advance(bound))) {
+                    return true;
+                }
+                last = bound;
+                p = close;
+                break;
+            }
+            case '[':
+                flush();
+                p = skip(p);
+                if (!*p || !advance(1)) return true;
+                break;
+            case '.':
+                flush();
+                if (!advance(1)) return true;
+                break;
+            case '^':
+            case '$':
+                flush();
+                last = 0;
+                break;
+            case '*':
+                // the previous element is optional and the rest is at an unbounded offset
+                if (!run.empty()) run.pop_back();
+                flush();
+                return true;
+            case '+':
+                flush();
+                return true;
+            case '?':
+                if (!run.empty()) run.pop_back();
+                flush();
+                p = skip_modifier(p);
+                break;
+            case '{': {
+                // only a well formed quantifier, otherwise the brace is a literal
+                char *end;
+                const char *q = p + 1;
+                const unsigned long min = ascii_digit(*q) ? strtoul(q, &end, 10) : 0;
+                if (ascii_digit(*q)) q = end;
+                bool upper = true;
+                unsigned long max = min;
+                if (*q == ',') {
+                    q++;
+                    upper = ascii_digit(*q);
+                    if (upper) {
+                        max = strtoul(q, &end, 10);
+                        q = end;
+                    }
+                }
+                if (*q != '}' || q == p + 1 || (q == p + 2 && p[1] == ',')) {
+                    if (!literal(c)) return true;
+                    break;
+                }
+                if (!min && !run.empty()) run.pop_back();
+                flush();
+                if (!upper || max > max_offset || (max && !advance(last * (max - 1)))) {
+                    return true;
+                }
+                p = skip_modifier(q);
+                break;
+            }
+            case '\\':
+                if (!*++p) return true;
+                if (*p == 'Q') {
+                    for (p++; *p && !(*p == '\\' && p[1] == 'E'); p++) {
+                        if (!literal(*p)) return true;
+                    }
+                    if (!*p) return true;
+                    p++;
+                } else if (*p == 'E') {
+                    // the end of a quote that never started
+                } else if ((ascii_lower(*p) >= 'a' && ascii_lower(*p) <= 'z') || ascii_digit(*p)) {
+                    // a class, assertion, backreference or character code
+                    flush();
+                    const char escape = *p;
+                    p = skip_escape(p);
+                    if ((ascii_digit(escape) && escape != '0') || strchr("gkX", escape)) {
+                        return true; // the length of what it matches isn't known
+                    }
+                    if (strchr("bBAzZGK", escape)) {
+                        last = 0;
+                    } else if (!advance(2)) {
+                        return true;
+                    }
+                } else if (!literal(*p)) {
+                    return true;
+                }
+                break;
+            default:
+                if (!literal(c)) return true;
+        }
+    }
+    flush();
+    return true;
+}
+
+#endif
@@ -18,17 +18,33 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstdlib>
 #include <cstring>
 #include <cmath>
+#include <deque>
 #include <functional>
 #include <limits>
 #include <map>
 #include <memory>
 #include <vector>
-#include <set>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
+#include <glib-unix.h>
 #include <gtk/gtk.h>
 #include <vte/vte.h>
 
@@ -39,6 +55,9 @@
 #include <gdk/gdkx.h>
 #endif
 
+#include <gio/gunixsocketaddress.h>
+
+#include "search_literals.hh"
 #include "url_regex.hh"
 #include "util/clamp.hh"
 #include "util/maybe.hh"
@@ -90,12 +109,56 @@ enum class vi_mode {
     visual_block
 };
 
+struct decoded_row {
+    std::vector<gunichar> codepoints; // without the trailing newline
+    std::vector<long> columns;        // column of each codepoint
+    bool wrapped;                     // soft wrapped into the next row
+    unsigned long last_use;
+};
+
+struct line_bounds {
+    long last; // the last row of the line
+    unsigned long last_use;
+};
+
+// rows decoded for the selection motions, dropped whenever the contents change except for the
+// line bounds of rows in the history
+struct row_cache {
+    std::unordered_map<long, decoded_row> rows;
+    std::map<long, line_bounds> lines; // by first row
+    long columns;
+    unsigned long use_counter;
+};
+
+// selection bounds kept as coordinates, the text is only produced when requested
+struct selection_range {
+    VteTerminal *vte;
+    long col, row, end_col, end_row; // the end column is inclusive
+    bool block;
+};
+
+// A selection copied to CLIPBOARD. The rows on the screen are read out when copying, the ones in
+// the history are left in the terminal while it can't drop them.
+struct copied_selection {
+    selection_range range; // empty once row is past end_row
+    std::string tail;      // text of the rows after the range
+    long columns;          // the width the rows of the range were wrapped at
+    long end;              // the last row of the buffer when last checked
+};
+
 struct select_info {
     vi_mode mode;
     long begin_col;
     long begin_row;
     long origin_col;
     long origin_row;
+    row_cache rows;
+    long count; // pending count prefix
+    selection_range range;
+    guint tick;        // pending selection update
+    gint64 next_apply; // earliest time for the next update
+    copied_selection clipboard;
+    bool owns_clipboard;
 };
 
 struct url_data {
@@ -104,12 +167,119 @@ struct url_data {
     long col, row;
 };
 
+struct url_match {
+    std::string url;
+    long col, row;
+};
+
+struct url_line {
+    long row, end_row;
+    std::string text;
+    std::vector<url_match> matches;
+};
+
+// urls found in the visible rows, rescanned only for lines whose text changed
+struct url_index {
+    std::vector<url_line> lines;
+    long columns;
+    bool dirty;
+};
+
+struct hint_marker {
+    cairo_surface_t *surface;
+    int width, height;
+};
+
+struct token_stats {
+    unsigned long uses;
+    unsigned long last_use;
+};
+
+// Words seen in the terminal for completion. Rows are indexed once they scroll into the history,
+// while the words of the screen, which may still be rewritten, are read again every time.
+struct token_index {
+    std::unordered_map<std::string, token_stats> tokens;
+    std::vector<const std::string *> sorted;
+    std::vector<const std::string *> pending;
+    std::vector<std::string> screen; // sorted and unique
+    long indexed_row;
+    unsigned long generation;
+    size_t limit;
+};
+
+struct search_match {
+    long row, col, end_row, end_col;
+};
+
+struct keybind_info;
+struct draw_cb_info;
+
+// A search running on the worker pool. Rows are handed out in chunks from the main loop and
+// the workers only share the compiled pattern and the cancellation flag.
+struct search_task {
+    ~search_task() { pcre2_code_free(code); }
+    std::atomic<bool> cancelled;
+    pcre2_code *code;
+    keybind_info *info; // cleared when cancelled
+    std::vector<std::pair<long, long>> ranges;
+    size_t range;
+    long next_row;
+    unsigned in_flight;
+    guint feed_source;
+    bool reverse;
+    long matches_end;
+};
+
+struct search_chunk {
+    std::shared_ptr<search_task> task;
+    long end_row;
+    char *text;
+    GArray *attributes;
+    uint32_t options; // for matching, PCRE2_NOTBOL if the text starts in the middle of a line
+    std::vector<search_match> matches;
+};
+
+// block numbers containing a trigram, as varint encoded deltas
+struct posting_list {
+    std::vector<uint8_t> data;
+    uint32_t last;
+};
+
+// Trigrams of the scrollback in blocks of rows, built as rows scroll into the history. Searches
+// only run the regex over blocks containing every trigram of the literals in the pattern.
+struct search_index {
+    std::unordered_map<uint32_t, posting_list> postings;
+    long base_row;
+    long columns;
+    uint32_t n_blocks;
+    guint idle_source;
+    bool enabled, wrap;
+    std::string pattern;
+    std::vector<search_match> matches; // every match of the pattern, in buffer order
+    long matches_end;                  // rows from here on may still change
+    bool has_match;
+    long match_row, match_col;
+    std::shared_ptr<search_task> task;
+};
+
+G_DECLARE_FINAL_TYPE(TermiteTokenModel, termite_token_model, TERMITE, TOKEN_MODEL, GObject)
+
 struct search_panel_info {
     GtkWidget *entry;
     GtkWidget *da;
     overlay_mode mode;
     std::vector<url_data> url_list;
     char *fulltext;
+    url_index urls;
+    std::map<std::pair<std::string, bool>, hint_marker> markers; // keyed by label and active state
+    double marker_scale;
+    token_index tokens;
+    TermiteTokenModel *token_model;
+    search_index search;
+    // entry and da are only created once an overlay is first shown
+    GtkWidget *entry_overlay, *hint_overlay;
+    keybind_info *keybind;
+    draw_cb_info *draw;
 };
 
 struct hint_info {
@@ -118,15 +288,82 @@ struct hint_info {
     double padding, border_width, roundness;
 };
 
+enum class scrollbar_position { off, left, right };
+
+// Everything read from the config file, kept so a reload only applies what changed.
+struct config_snapshot {
+    gboolean scroll_on_output, scroll_on_keystroke, audible_bell, mouse_autohide, allow_bold;
+    gboolean search_wrap, hyperlinks, bold_is_bright;
+    gboolean dynamic_title, urgent_on_bell, clickable_url, size_hints, filter_unmatched_urls;
+    gboolean modify_other_keys, fullscreen, search_index;
+    double cell_height_scale, cell_width_scale;
+    long completion_tokens;
+    std::string browser;
+    maybe<std::string> font, icon_name;
+    maybe<int> scrollback_lines;
+    gint64 scrollback_bytes;
+    double memory_pressure;
+    long idle_reclaim;
+    maybe<VteCursorBlinkMode> cursor_blink;
+    maybe<VteCursorShape> cursor_shape;
+    scrollbar_position scrollbar;
+    std::array<GdkRGBA, 256> palette;
+    maybe<GdkRGBA> foreground, foreground_bold, background, cursor, cursor_foreground, highlight;
+    maybe<std::string> hint_font;
+    GdkRGBA hint_fg, hint_bg, hint_af, hint_ab;
+    maybe<GdkRGBA> hint_border;
+    double hint_padding, hint_border_width, hint_roundness;
+};
+
 struct config_info {
     hint_info hints;
     char *browser;
     gboolean dynamic_title, urgent_on_bell, clickable_url, size_hints;
     gboolean filter_unmatched_urls, modify_other_keys;
     gboolean fullscreen;
+    gboolean search_wrap, search_index;
     int tag;
     char *config_file;
     gdouble font_scale;
+    long completion_tokens;
+    std::unique_ptr<config_snapshot> applied;
+    GtkCssProvider *background; // held by the style context of the window
+};
+
+// Text written to the child a chunk at a time, whenever the pty can take more.
+struct paste_info {
+    std::deque<std::pair<std::string, bool>> pending; // text, and whether it is a paste
+    size_t offset;                                    // into the front of pending
+    size_t total, written;
+    guint watch;
+    bool progress;  // shown in the entry
+    bool bracketed; // the paste being written was started with a bracketed paste marker
+};
+
+// what the history of a terminal is estimated to hold, and the line limit set to trim it
+struct scrollback_usage {
+    long configured, limit;
+    long rows;
+    double row_bytes;
+    bool pressured;      // trimmed for the current episode of memory pressure
+    long pressure_limit; // the lines kept until it ends
+};
+
+// caches of an unfocused window are dropped once it has been idle for a while
+struct idle_info {
+    guint timer;
+    bool reclaimed;
+};
+
+enum class latency_path { insert, selection, overlay };
+
+// The oldest key press not yet shown in a frame.
+struct latency_probe {
+    gint64 key_time;
+    latency_path path;
+    bool waiting_output, waiting_paint;
+    GdkFrameClock *clock;
+    gulong paint_handler;
 };
 
 struct keybind_info {
@@ -136,6 +373,11 @@ struct keybind_info {
     select_info select;
     config_info config;
     std::function<void (GtkWindow *)> fullscreen_toggle;
+    paste_info paste;
+    latency_probe latency;
+    scrollback_usage scrollback;
+    idle_info idle;
+    GCancellable *spawn; // the child still being started
 };
 
 struct draw_cb_info {
@@ -145,6 +387,21 @@ struct draw_cb_info {
     gboolean filter_unmatched_urls;
 };
 
+struct window_info {
+    keybind_info keybind;
+    draw_cb_info draw;
+    GtkWidget *scrollbar, *hbox;
+};
+
+struct window_options {
+    char *directory;
+    char *execute;
+    char *role;
+    char *title;
+    char *icon;
+    gboolean hold;
+};
+
 static void launch_browser(char *browser, char *url);
 static void window_title_cb(VteTerminal *vte, gboolean *dynamic_title);
 static gboolean window_state_cb(GtkWindow *window, GdkEventWindowState *event, keybind_info *info);
@@ -153,11 +410,17 @@ static gboolean entry_key_press_cb(GtkEntry *entry, GdkEventKey *event, keybind_
 static gboolean position_overlay_cb(GtkBin *overlay, GtkWidget *widget, GdkRectangle *alloc);
 static gboolean button_press_cb(VteTerminal *vte, GdkEventButton *event, const config_info *info);
 static void bell_cb(GtkWidget *vte, gboolean *urgent_on_bell);
-static gboolean focus_cb(GtkWindow *window);
-
-static GtkTreeModel *create_completion_model(VteTerminal *vte);
-static void search(VteTerminal *vte, const char *pattern, bool reverse);
+static gboolean focus_cb(GtkWindow *window, GdkEventFocus *event, keybind_info *info);
+
+static void search(keybind_info *info, const char *pattern, bool reverse);
+static void search_next(keybind_info *info, bool reverse);
+static void cancel_search(search_index *index);
+static void paste_clipboard(VteTerminal *vte);
+static void feed_child_async(keybind_info *info, std::string text, bool paste);
+static void cancel_paste(keybind_info *info);
 static void overlay_show(search_panel_info *info, overlay_mode mode, VteTerminal *vte);
+static GtkWidget *hint_area(search_panel_info *panel);
+static GtkWidget *panel_entry(search_panel_info *panel);
 static void get_vte_padding(VteTerminal *vte, int *left, int *top, int *right, int *bottom);
 static char *check_match(VteTerminal *vte, GdkEventButton *event);
 static void load_config(GtkWindow *window, VteTerminal *vte, GtkWidget *scrollbar, GtkWidget *hbox,
@@ -165,12 +428,52 @@ static void load_config(GtkWindow *window, VteTerminal *vte, GtkWidget *scrollba
 static void set_config(GtkWindow *window, VteTerminal *vte, GtkWidget *scrollbar, GtkWidget *hbox,
                        config_info *info, char **icon, bool *show_scrollbar,
                        GKeyFile *config);
+static bool same_hints(const config_snapshot &a, const config_snapshot &b);
 static long first_row(VteTerminal *vte);
+static long last_row(VteTerminal *vte);
+static window_info *create_window(window_options *opts);
+static bool start_recording(VteTerminal *vte, const char *directory, char **argv, char **env);
+#if VTE_CHECK_VERSION(0, 68, 0)
+static bool recorded_paste_mode(VteTerminal *vte, bool *bracketed);
+static void reset_recorded_paste_mode(VteTerminal *vte);
+#endif
+static void reload_config();
+
+static std::vector<window_info *> windows;
+static bool daemon_mode = false;
+static GKeyFile *resident_config = nullptr;
+static char *config_path = nullptr;
+static char *bench_file = nullptr;
+static char *stats_file = nullptr;
+static char *record_file = nullptr;
+static char *record_rotate = nullptr;
+static gint record_fsync = -1;
+static gboolean startup_profile = FALSE;
+static gint64 startup_time, startup_mark;
+static size_t reclaimed_bytes = 0; // estimated total dropped by idle reclaim, for the stats
+
+// Print the time spent since the previous phase, until the first window has been drawn.
+static void profile_phase(const char *phase) {
+    if (!startup_profile) {
+        return;
+    }
+    const gint64 now = g_get_monotonic_time();
+    g_printerr("startup: %-14s %9.3f ms %9.3f ms total\n", phase,
+               (double)(now - startup_mark) / 1000, (double)(now - startup_time) / 1000);
+    startup_mark = now;
+}
 
-static std::function<void ()> reload_config;
+static void first_paint_cb(GdkFrameClock *clock, gpointer) {
+    profile_phase("first paint");
+    startup_profile = FALSE;
+    g_signal_handlers_disconnect_by_func(clock, (gpointer)first_paint_cb, nullptr);
+}
 
-static void override_background_color(GtkWidget *widget, GdkRGBA *rgba) {
-    GtkCssProvider *provider = gtk_css_provider_new();
+// A provider set before through kept is reloaded with the new color instead of adding another.
+static void override_background_color(GtkWidget *widget, GdkRGBA *rgba,
+                                      GtkCssProvider **kept = nullptr) {
+    const bool added = kept && *kept;
+    GtkCssProvider *provider = added ? *kept : gtk_css_provider_new();
 
     gchar *colorstr = gdk_rgba_to_string(rgba);
     char *css = g_strdup_printf("* { background-color: %s; }", colorstr);
@@ -178,10 +481,21 @@ static void override_background_color(GtkWidget *widget, GdkRGBA *rgba) {
     g_free(colorstr);
     g_free(css);
 
-    gtk_style_context_add_provider(gtk_widget_get_style_context(widget),
-                                   GTK_STYLE_PROVIDER(provider),
-                                   GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
-    g_object_unref(provider);
+    if (!added) {
+        gtk_style_context_add_provider(gtk_widget_get_style_context(widget),
+                                       GTK_STYLE_PROVIDER(provider),
+                                       GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+        g_object_unref(provider);
+    }
+    if (kept) {
+        *kept = provider;
+    }
+}
+
+static void hide_overlay_widget(GtkWidget *widget) {
+    if (widget) {
+        gtk_widget_hide(widget);
+    }
 }
 
 static const std::map<int, const char *> modify_table = {
@@ -298,49 +612,106 @@ static void launch_in_directory(VteTerminal *vte) {
         return;
     }
     auto dir = make_unique(g_filename_from_uri(uri, nullptr, nullptr), g_free);
+    if (daemon_mode) {
+        window_options opts{dir.get(), nullptr, nullptr, nullptr, nullptr, FALSE};
+        create_window(&opts);
+        return;
+    }
     char term[] = "termite"; // maybe this should be argv[0]
     char *cmd[] = {term, nullptr};
     g_spawn_async(dir.get(), cmd, nullptr, G_SPAWN_SEARCH_PATH, nullptr, nullptr, nullptr, nullptr);
 }
 
-static void find_urls(VteTerminal *vte, search_panel_info *panel_info) {
-    GRegex *regex = g_regex_new(url_regex, G_REGEX_CASELESS, G_REGEX_MATCH_NOTEMPTY, nullptr);
-    GArray *attributes = g_array_new(FALSE, FALSE, sizeof(VteCharAttributes));
-    auto content = make_unique(vte_terminal_get_text(vte, nullptr, nullptr, attributes), g_free);
-
-    for (char *s_ptr = content.get(), *saveptr; ; s_ptr = nullptr) {
-        const char *token = strtok_r(s_ptr, "\n", &saveptr);
-        if (!token) {
-            break;
-        }
+/* {{{ REGEX CACHE */
+struct cached_regex {
+    pcre2_code *code;
+    pcre2_match_data *match_data;
+    VteRegex *match;
+    VteRegex *search;
+    unsigned long last_use;
+};
 
-        GError *error = nullptr;
-        GMatchInfo *info;
+// Compiled patterns shared by hints, clickable urls and searches in every window. The match
+// data is reused between calls, so the pcre2 side must only be used from the main thread.
+static std::map<std::pair<std::string, uint32_t>, cached_regex> regex_cache;
+static const size_t regex_cache_size = 32;
 
-        g_regex_match_full(regex, token, -1, 0, (GRegexMatchFlags)0, &info, &error);
-        while (g_match_info_matches(info)) {
-            int pos;
-            g_match_info_fetch_pos(info, 0, &pos, nullptr);
+static void free_cached_regex(cached_regex &regex) {
+    if (regex.match_data) pcre2_match_data_free(regex.match_data);
+    if (regex.code) pcre2_code_free(regex.code);
+    if (regex.match) vte_regex_unref(regex.match);
+    if (regex.search) vte_regex_unref(regex.search);
+}
 
-            const long first_row = g_array_index(attributes, VteCharAttributes, 0).row;
-            const auto attr = g_array_index(attributes, VteCharAttributes, token + pos - content.get());
+static cached_regex &lookup_regex(const char *pattern, uint32_t flags) {
+    static unsigned long use_counter = 0;
+    auto key = std::make_pair(std::string(pattern), flags);
+
+    auto it = regex_cache.find(key);
+    if (it == regex_cache.end()) {
+        if (regex_cache.size() >= regex_cache_size) {
+            auto lru = std::min_element(regex_cache.begin(), regex_cache.end(),
+                                        [](const decltype(*it) &a, const decltype(*it) &b) {
+                                            return a.second.last_use < b.second.last_use;
+                                        });
+            free_cached_regex(lru->second);
+            regex_cache.erase(lru);
+        }
+        it = regex_cache.emplace(key, cached_regex{nullptr, nullptr, nullptr, nullptr, 0}).first;
+    }
+    it->second.last_use = ++use_counter;
+    return it->second;
+}
 
-            panel_info->url_list.emplace_back(g_match_info_fetch(info, 0),
-                                              attr.column,
-                                              attr.row - first_row);
-            g_match_info_next(info, &error);
+static cached_regex *get_pcre_regex(const char *pattern, uint32_t flags) {
+    cached_regex &regex = lookup_regex(pattern, flags);
+    if (!regex.code) {
+        int errorcode;
+        PCRE2_SIZE erroroffset;
+        regex.code = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED, flags | PCRE2_UTF,
+                                   &errorcode, &erroroffset, nullptr);
+        if (!regex.code) {
+            PCRE2_UCHAR message[256];
+            pcre2_get_error_message(errorcode, message, sizeof(message));
+            g_printerr("invalid regex at offset %zu: %s\n", (size_t)erroroffset, (char *)message);
+            return nullptr;
         }
+        pcre2_jit_compile(regex.code, PCRE2_JIT_COMPLETE); // falls back to the interpreter
+    }
+    if (!regex.match_data) {
+        regex.match_data = pcre2_match_data_create_from_pattern(regex.code, nullptr);
+    }
+    return &regex;
+}
 
-        g_match_info_free(info);
+// Compiled again on the next use. The VTE regexes are kept, as the terminals hold them anyway.
+static void release_pcre_regexes() {
+    for (auto &entry : regex_cache) {
+        cached_regex &regex = entry.second;
+        if (regex.match_data) pcre2_match_data_free(regex.match_data);
+        if (regex.code) pcre2_code_free(regex.code);
+        regex.match_data = nullptr;
+        regex.code = nullptr;
+    }
+}
 
-        if (error) {
-            g_printerr("error while matching: %s\n", error->message);
+static VteRegex *get_vte_regex(const char *pattern, uint32_t flags, bool for_search) {
+    cached_regex &regex = lookup_regex(pattern, flags);
+    VteRegex *&vte_regex = for_search ? regex.search : regex.match;
+    if (!vte_regex) {
+        GError *error = nullptr;
+        vte_regex = (for_search ? vte_regex_new_for_search : vte_regex_new_for_match)
+            (pattern, (gssize)strlen(pattern), flags, &error);
+        if (!vte_regex) {
+            g_printerr("invalid regex: %s\n", error->message);
             g_error_free(error);
+            return nullptr;
         }
+        vte_regex_jit(vte_regex, PCRE2_JIT_COMPLETE, nullptr);
     }
-    g_regex_unref(regex);
-    g_array_free(attributes, TRUE);
+    return vte_regex;
 }
+/* }}} */
 
 static void launch_url(char *browser, const char *text, search_panel_info *info) {
     char *end;
@@ -363,129 +734,574 @@ static void draw_rectangle(cairo_t *cr, double x, double y, double height,
     cairo_close_path(cr);
 }
 
-static void draw_marker(cairo_t *cr, const PangoFontDescription *desc,
-                        const hint_info *hints, long x, long y, const char *msg,
-                        bool active) {
-    cairo_text_extents_t ext;
+static hint_marker render_marker(cairo_t *cr, const PangoFontDescription *desc,
+                                 const hint_info *hints, const char *msg, bool active) {
     int width, height;
 
-    cairo_text_extents(cr, msg, &ext);
     PangoLayout *layout = pango_cairo_create_layout(cr);
     pango_layout_set_font_description(layout, desc);
     pango_layout_set_text(layout, msg, -1);
     pango_layout_get_size(layout, &width, &height);
 
-    draw_rectangle(cr, static_cast<double>(x), static_cast<double>(y),
-                   static_cast<double>(width / PANGO_SCALE) + hints->padding * 2,
-                   static_cast<double>(height / PANGO_SCALE) + hints->padding * 2,
-                   hints->roundness);
-    cairo_set_source(cr, hints->border);
-    cairo_set_line_width(cr, hints->border_width);
-    cairo_stroke_preserve(cr);
-    cairo_set_source(cr, active ? hints->ab : hints->bg);
-    cairo_fill(cr);
-
-    cairo_new_path(cr);
-    cairo_move_to(cr, static_cast<double>(x) + hints->padding,
-                  static_cast<double>(y) + hints->padding);
-
-    cairo_set_source(cr, active ? hints->af : hints->fg);
-    pango_cairo_update_layout(cr, layout);
-    pango_cairo_layout_path(cr, layout);
-    cairo_fill(cr);
-
+    // the border is stroked centered on the outline, so half of it lies outside the box
+    const double offset = hints->border_width / 2;
+    const double box_width = static_cast<double>(width / PANGO_SCALE) + hints->padding * 2;
+    const double box_height = static_cast<double>(height / PANGO_SCALE) + hints->padding * 2;
+
+    hint_marker marker;
+    marker.width = static_cast<int>(std::ceil(box_width + hints->border_width));
+    marker.height = static_cast<int>(std::ceil(box_height + hints->border_width));
+    marker.surface = cairo_surface_create_similar(cairo_get_target(cr), CAIRO_CONTENT_COLOR_ALPHA,
+                                                  marker.width, marker.height);
+
+    cairo_t *mcr = cairo_create(marker.surface);
+    draw_rectangle(mcr, offset, offset, box_width, box_height, hints->roundness);
+    cairo_set_source(mcr, hints->border);
+    cairo_set_line_width(mcr, hints->border_width);
+    cairo_stroke_preserve(mcr);
+    cairo_set_source(mcr, active ? hints->ab : hints->bg);
+    cairo_fill(mcr);
+
+    cairo_new_path(mcr);
+    cairo_move_to(mcr, offset + hints->padding, offset + hints->padding);
+
+    cairo_set_source(mcr, active ? hints->af : hints->fg);
+    pango_cairo_update_layout(mcr, layout);
+    pango_cairo_layout_path(mcr, layout);
+    cairo_fill(mcr);
+
+    cairo_destroy(mcr);
     g_object_unref(layout);
+    return marker;
+}
+
+static void clear_marker_cache(search_panel_info *panel) {
+    for (auto &marker : panel->markers) {
+        cairo_surface_destroy(marker.second.surface);
+    }
+    panel->markers.clear();
+}
+
+static const hint_marker &get_marker(search_panel_info *panel, cairo_t *cr,
+                                     const PangoFontDescription *desc, const hint_info *hints,
+                                     const char *msg, bool active) {
+    auto key = std::make_pair(std::string(msg), active);
+    auto it = panel->markers.find(key);
+    if (it == panel->markers.end()) {
+        it = panel->markers.emplace(key, render_marker(cr, desc, hints, msg, active)).first;
+    }
+    return it->second;
+}
+
+static void marker_origin(VteTerminal *vte, const hint_info *hints, const url_data &data,
+                          double *x, double *y) {
+    int padding_left, padding_top, padding_right, padding_bottom;
+    get_vte_padding(vte, &padding_left, &padding_top, &padding_right, &padding_bottom);
+    *x = static_cast<double>(data.col * vte_terminal_get_char_width(vte) + padding_left) -
+         hints->border_width / 2;
+    *y = static_cast<double>(data.row * vte_terminal_get_char_height(vte) + padding_top) -
+         hints->border_width / 2;
+}
+
+static bool marker_active(const char *label, const char *text) {
+    return text && *text && strncmp(label, text, strlen(text)) == 0;
+}
+
+static bool marker_visible(bool filter_unmatched_urls, const char *label, const char *text) {
+    return !filter_unmatched_urls || !text || !*text || marker_active(label, text);
 }
 
 static gboolean draw_cb(const draw_cb_info *info, cairo_t *cr) {
     if (!info->panel->url_list.empty()) {
         char buffer[std::numeric_limits<unsigned>::digits10 + 1];
 
-        int padding_left, padding_top, padding_right, padding_bottom;
-        const long cw = vte_terminal_get_char_width(info->vte);
-        const long ch = vte_terminal_get_char_height(info->vte);
         const PangoFontDescription *desc = info->hints->font ?
             info->hints->font : vte_terminal_get_font(info->vte);
-        size_t len = info->panel->fulltext == nullptr ?
-            0 : strlen(info->panel->fulltext);
 
-        cairo_set_line_width(cr, 1);
-        cairo_set_source_rgb(cr, 0, 0, 0);
-        cairo_stroke(cr);
+        const double scale = vte_terminal_get_font_scale(info->vte);
+        if (scale != info->panel->marker_scale) {
+            clear_marker_cache(info->panel);
+            info->panel->marker_scale = scale;
+        }
 
-        get_vte_padding(info->vte, &padding_left, &padding_top, &padding_right, &padding_bottom);
+        GdkRectangle clip;
+        const bool clipped = gdk_cairo_get_clip_rectangle(cr, &clip);
 
         for (unsigned i = 0; i < info->panel->url_list.size(); i++) {
-            const url_data &data = info->panel->url_list[i];
-            const long x = data.col * cw + padding_left;
-            const long y = data.row * ch + padding_top;
-            bool active = false;
-
             snprintf(buffer, sizeof(buffer), "%u", i + 1);
-            if (len)
-                active = strncmp(buffer, info->panel->fulltext, len) == 0;
-
-            if (!info->filter_unmatched_urls || active || len == 0)
-                draw_marker(cr, desc, info->hints, x, y, buffer, active);
+            if (!marker_visible(info->filter_unmatched_urls, buffer, info->panel->fulltext))
+                continue;
+
+            double x, y;
+            marker_origin(info->vte, info->hints, info->panel->url_list[i], &x, &y);
+            const bool active = marker_active(buffer, info->panel->fulltext);
+            const hint_marker &marker = get_marker(info->panel, cr, desc, info->hints,
+                                                   buffer, active);
+
+            // only the damaged markers need to be composited
+            if (clipped && (x >= clip.x + clip.width || y >= clip.y + clip.height ||
+                            x + marker.width <= clip.x || y + marker.height <= clip.y))
+                continue;
+
+            cairo_set_source_surface(cr, marker.surface, x, y);
+            cairo_paint(cr);
         }
     }
 
     return FALSE;
 }
 
-static void update_selection(VteTerminal *vte, const select_info *select) {
+// Queue redraws for the markers whose state differs between the two hint inputs.
+static void queue_marker_redraw(const keybind_info *info, const char *previous, const char *text) {
+    const search_panel_info &panel = info->panel;
+    char buffer[std::numeric_limits<unsigned>::digits10 + 1];
+    const gboolean filter = info->config.filter_unmatched_urls;
+
+    for (unsigned i = 0; i < panel.url_list.size(); i++) {
+        snprintf(buffer, sizeof(buffer), "%u", i + 1);
+        if (marker_active(buffer, previous) == marker_active(buffer, text) &&
+            marker_visible(filter, buffer, previous) == marker_visible(filter, buffer, text))
+            continue;
+
+        // the size doesn't depend on the state, so either rendering will do
+        auto it = panel.markers.find(std::make_pair(std::string(buffer), false));
+        if (it == panel.markers.end())
+            it = panel.markers.find(std::make_pair(std::string(buffer), true));
+        if (it == panel.markers.end()) {
+            gtk_widget_queue_draw(panel.da);
+            return;
+        }
+
+        double x, y;
+        marker_origin(info->vte, &info->config.hints, panel.url_list[i], &x, &y);
+        gtk_widget_queue_draw_area(panel.da, static_cast<int>(std::floor(x)),
+                                   static_cast<int>(std::floor(y)),
+                                   it->second.width + 1, it->second.height + 1);
+    }
+}
+
+static std::unique_ptr<char, decltype(&g_free)>
+get_text_range(VteTerminal *vte, long start_row, long start_col, long end_row, long end_col) {
+    return {vte_terminal_get_text_range(vte, start_row, start_col, end_row, end_col,
+                                        nullptr, nullptr, nullptr), g_free};
+}
+
+static const size_t row_cache_size = 256;
+static const long line_walk_rows = 1024; // the most rows looked at on each side of a line
+
+static void clear_row_cache(row_cache *cache) {
+    cache->rows.clear();
+    cache->lines.clear();
+}
+
+// Rows in the history only change when they are rewrapped, which clears everything, so the
+// lines found there stay valid until they scroll off the top.
+static void row_cache_contents_changed(keybind_info *info) {
+    row_cache *cache = &info->select.rows;
+    const long first = first_row(info->vte);
+    const long history_end = last_row(info->vte) + 1 - vte_terminal_get_row_count(info->vte);
+    cache->rows.clear();
+    for (auto it = cache->lines.begin(); it != cache->lines.end();) {
+        if (it->first < first || it->second.last >= history_end) {
+            it = cache->lines.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Everything is rewrapped when the width changes, which doesn't always show as a change of
+// contents first.
+static long row_cache_columns(VteTerminal *vte, row_cache *cache) {
+    const long columns = vte_terminal_get_column_count(vte);
+    if (columns != cache->columns) {
+        clear_row_cache(cache);
+        cache->columns = columns;
+    }
+    return columns;
+}
+
+// drop the least recently used entry once the map is full
+template<typename Map>
+static void evict_row_cache(Map *map) {
+    using entry = typename Map::value_type;
+    if (map->size() >= row_cache_size) {
+        map->erase(std::min_element(map->begin(), map->end(), [](const entry &a, const entry &b) {
+            return a.second.last_use < b.second.last_use;
+        }));
+    }
+}
+
+static const decoded_row &decode_row(VteTerminal *vte, row_cache *cache, long row) {
+    const long columns = row_cache_columns(vte, cache);
+
+    auto it = cache->rows.find(row);
+    if (it == cache->rows.end()) {
+        evict_row_cache(&cache->rows);
+        it = cache->rows.emplace(row, decoded_row{{}, {}, false, 0}).first;
+
+        GArray *attributes = g_array_new(FALSE, FALSE, sizeof(VteCharAttributes));
+        auto content = make_unique(vte_terminal_get_text_range(vte, row, 0, row, columns - 1,
+                                                               nullptr, nullptr, attributes),
+                                   g_free);
+        if (content) {
+            const char *text = content.get(), *p = text;
+            for (; *p && *p != '\n'; p = g_utf8_next_char(p)) {
+                it->second.codepoints.push_back(g_utf8_get_char(p));
+                it->second.columns.push_back(
+                    g_array_index(attributes, VteCharAttributes, p - text).column);
+            }
+            // only rows ending a line get a newline
+            it->second.wrapped = !*p && p != text;
+        }
+        g_array_free(attributes, TRUE);
+    }
+    it->second.last_use = ++cache->use_counter;
+    return it->second;
+}
+
+// index of the first codepoint at or after the column
+static long codepoint_at(const decoded_row &row, long column) {
+    return std::lower_bound(row.columns.begin(), row.columns.end(), column) - row.columns.begin();
+}
+
+// Whether the row is soft wrapped into the next one, as only rows ending a line get a newline.
+static bool row_soft_wrapped(VteTerminal *vte, long row) {
+    auto content = get_text_range(vte, row, 0, row, vte_terminal_get_column_count(vte) - 1);
+    return content && *content && !strchr(content.get(), '\n');
+}
+
+// Whether the row is soft wrapped, without decoding it into the cache.
+static bool row_wrapped(VteTerminal *vte, row_cache *cache, long row) {
+    row_cache_columns(vte, cache);
+    auto it = cache->rows.find(row);
+    if (it != cache->rows.end()) {
+        return it->second.wrapped;
+    }
+    return row_soft_wrapped(vte, row);
+}
+
+// First and last row of the soft wrapped line containing row, looking at most line_walk_rows
+// rows away on each side. The walk is only done once per line, as the result is remembered.
+static std::pair<long, long> logical_line(VteTerminal *vte, row_cache *cache, long row) {
+    row_cache_columns(vte, cache);
+    auto it = cache->lines.upper_bound(row);
+    if (it != cache->lines.begin() && (--it)->second.last >= row) {
+        it->second.last_use = ++cache->use_counter;
+        return {it->first, it->second.last};
+    }
+
+    long start = row, end = row;
+    const long first = std::max(first_row(vte), row - line_walk_rows);
+    const long last = std::min(last_row(vte), row + line_walk_rows);
+    while (start > first && row_wrapped(vte, cache, start - 1)) {
+        start--;
+    }
+    while (end < last && row_wrapped(vte, cache, end)) {
+        end++;
+    }
+    // a line cut short isn't the same for its other rows
+    if ((start > first_row(vte) && start == first) || (end < last_row(vte) && end == last)) {
+        return {start, end};
+    }
+    evict_row_cache(&cache->lines);
+    cache->lines[start] = {end, ++cache->use_counter};
+    return {start, end};
+}
+
+struct text_position {
+    long row;
+    long index; // codepoint within the row
+};
+
+// Step to the next codepoint of the logical line.
+static bool next_position(VteTerminal *vte, row_cache *cache, text_position *pos) {
+    const decoded_row &row = decode_row(vte, cache, pos->row);
+    if (pos->index + 1 < (long)row.codepoints.size()) {
+        pos->index++;
+        return true;
+    }
+    if (!row.wrapped || pos->row >= last_row(vte) ||
+        decode_row(vte, cache, pos->row + 1).codepoints.empty()) {
+        return false;
+    }
+    *pos = {pos->row + 1, 0};
+    return true;
+}
+
+static bool prev_position(VteTerminal *vte, row_cache *cache, text_position *pos) {
+    if (pos->index > 0) {
+        pos->index--;
+        return true;
+    }
+    if (pos->row <= first_row(vte)) {
+        return false;
+    }
+    const decoded_row &row = decode_row(vte, cache, pos->row - 1);
+    if (!row.wrapped || row.codepoints.empty()) {
+        return false;
+    }
+    *pos = {pos->row - 1, (long)row.codepoints.size() - 1};
+    return true;
+}
+
+static gunichar char_at(VteTerminal *vte, row_cache *cache, const text_position &pos) {
+    return decode_row(vte, cache, pos.row).codepoints[(size_t)pos.index];
+}
+
+static void set_cursor_position(VteTerminal *vte, row_cache *cache, const text_position &pos) {
+    vte_terminal_set_cursor_position(vte, decode_row(vte, cache, pos.row).columns[(size_t)pos.index],
+                                     pos.row);
+}
+
+// Read the selected text a bounded number of rows at a time, rather than having VTE build
+// one more copy of the whole selection.
+static char *selection_text(const selection_range &range) {
+    static const long chunk_rows = 1024;
+
+    const long end_col = vte_terminal_get_column_count(range.vte) - 1;
+    GString *text = g_string_new(nullptr);
+    for (long row = range.row; row <= range.end_row; ) {
+        if (range.block) {
+            if (auto content = get_text_range(range.vte, row, range.col, row, range.end_col)) {
+                g_string_append(text, content.get());
+            }
+            if (!text->len || text->str[text->len - 1] != '\n') {
+                g_string_append_c(text, '\n');
+            }
+            row++;
+            continue;
+        }
+        const long chunk_end = std::min(row + chunk_rows - 1, range.end_row);
+        if (auto content = get_text_range(range.vte, row, row == range.row ? range.col : 0,
+                                          chunk_end, chunk_end == range.end_row ? range.end_col : end_col)) {
+            g_string_append(text, content.get());
+        }
+        row = chunk_end + 1;
+    }
+    return g_string_free(text, FALSE);
+}
+
+static char *copied_text(const copied_selection &copied) {
+    GString *text = g_string_new(nullptr);
+    if (copied.range.row <= copied.range.end_row) {
+        auto middle = make_unique(selection_text(copied.range), g_free);
+        g_string_append(text, middle.get());
+    }
+    g_string_append(text, copied.tail.c_str());
+    return g_string_free(text, FALSE);
+}
+
+static void clipboard_get_cb(GtkClipboard *, GtkSelectionData *data, guint, gpointer user_data) {
+    auto text = make_unique(copied_text(static_cast<select_info *>(user_data)->clipboard), g_free);
+    gtk_selection_data_set_text(data, text.get(), -1);
+}
+
+static void clipboard_clear_cb(GtkClipboard *, gpointer user_data) {
+    static_cast<select_info *>(user_data)->owns_clipboard = false;
+}
+
+static bool claim_selection(VteTerminal *vte, GdkAtom atom, GtkClipboardGetFunc get,
+                            GtkClipboardClearFunc clear, select_info *select) {
+    GtkTargetList *list = gtk_target_list_new(nullptr, 0);
+    gtk_target_list_add_text_targets(list, 0);
+    gint n_targets;
+    GtkTargetEntry *targets = gtk_target_table_new_from_list(list, &n_targets);
+    const bool owned = gtk_clipboard_set_with_data(gtk_widget_get_clipboard(GTK_WIDGET(vte), atom),
+                                                   targets, (guint)n_targets, get, clear, select);
+    gtk_target_table_free(targets, n_targets);
+    gtk_target_list_unref(list);
+    return owned;
+}
+
+// Rows only leave an unbounded history when it is cleared or trimmed by termite, so a range in
+// it can be read later on. VTE stores an unbounded limit as G_MAXLONG.
+static bool scrollback_unbounded(VteTerminal *vte) {
+#if VTE_CHECK_VERSION(0, 52, 0)
+    const glong lines = vte_terminal_get_scrollback_lines(vte);
+    return lines < 0 || lines == G_MAXLONG;
+#else
+    return false;
+#endif
+}
+
+// Replace a lazily provided selection with a copy of its text. Setting the text drops
+// ownership through the clear callback.
+static void materialize_selection(const copied_selection &copied, GdkAtom atom) {
+    auto text = make_unique(copied_text(copied), g_free);
+    gtk_clipboard_set_text(gtk_widget_get_clipboard(GTK_WIDGET(copied.range.vte), atom),
+                           text.get(), -1);
+}
+
+// The rows are cleared by the child with a reset or an erase of the scrollback, and rewrapped by
+// a resize termite didn't see coming. Giving up the clipboard is better than handing out text
+// that was never copied.
+static void selection_contents_changed(select_info *select) {
+    copied_selection &copied = select->clipboard;
+    if (!select->owns_clipboard) {
+        return;
+    }
+    VteTerminal *vte = copied.range.vte;
+    if (vte_terminal_get_column_count(vte) != copied.columns || last_row(vte) < copied.end ||
+        (copied.range.row <= copied.range.end_row && copied.range.row < first_row(vte))) {
+        gtk_clipboard_clear(gtk_widget_get_clipboard(GTK_WIDGET(vte), GDK_SELECTION_CLIPBOARD));
+        return;
+    }
+    copied.end = last_row(vte);
+}
+
+// Keep the text of CLIPBOARD available once the window is gone. When the process is about to
+// exit it is also handed to the clipboard manager, if there is one.
+static void release_clipboard(select_info *select, bool exiting) {
+    if (!select->owns_clipboard) {
+        return;
+    }
+    VteTerminal *vte = select->clipboard.range.vte;
+    materialize_selection(select->clipboard, GDK_SELECTION_CLIPBOARD);
+    if (exiting) {
+        GtkClipboard *clipboard = gtk_widget_get_clipboard(GTK_WIDGET(vte),
+                                                           GDK_SELECTION_CLIPBOARD);
+        gtk_clipboard_set_can_store(clipboard, nullptr, 0);
+        gtk_clipboard_store(clipboard);
+    }
+}
+
+static void exit_release_clipboard(select_info *select) {
+    release_clipboard(select, true);
+}
+
+static void release_clipboard_cb(select_info *select) {
+    release_clipboard(select, false);
+}
+
+// Called before the history is reset, trimmed or rewrapped.
+static void keep_clipboard_text(VteTerminal *vte) {
+    for (window_info *win : windows) {
+        if (win->keybind.vte == vte) {
+            release_clipboard(&win->keybind.select, false);
+        }
+    }
+}
+
+static void apply_selection(VteTerminal *vte, select_info *select) {
     vte_terminal_unselect_all(vte);
 
-    if (select->mode == vi_mode::command) {
+    if (select->mode == vi_mode::command || select->mode == vi_mode::insert) {
         return;
     }
 
     const long n_columns = vte_terminal_get_column_count(vte);
-    long cursor_col, cursor_row, selection_x_end;
+    long cursor_col, cursor_row;
     vte_terminal_get_cursor_position(vte, &cursor_col, &cursor_row);
 
-    vte_terminal_set_selection_block_mode(vte, select->mode == vi_mode::visual_block);
+    selection_range &range = select->range;
+    range.vte = vte;
+    range.block = select->mode == vi_mode::visual_block;
+    vte_terminal_set_selection_block_mode(vte, range.block);
 
     if (select->mode == vi_mode::visual) {
         const long begin = select->begin_row * n_columns + select->begin_col;
         const long end = cursor_row * n_columns + cursor_col;
         if (begin < end) {
-            selection_x_end = cursor_col;
-#if VTE_CHECK_VERSION(0, 55, 0)
-            selection_x_end += 1;
-#endif
-            vte_terminal_select_text(vte, select->begin_col, select->begin_row,
-                                     selection_x_end, cursor_row);
+            range = {vte, select->begin_col, select->begin_row, cursor_col, cursor_row, false};
         } else {
-            selection_x_end = select->begin_col;
-#if VTE_CHECK_VERSION(0, 55, 0)
-            selection_x_end += 1;
-#endif
-            vte_terminal_select_text(vte, cursor_col, cursor_row,
-                                     selection_x_end, select->begin_row);
+            range = {vte, cursor_col, cursor_row, select->begin_col, select->begin_row, false};
         }
     } else if (select->mode == vi_mode::visual_line) {
-        selection_x_end = n_columns - 1;
-#if VTE_CHECK_VERSION(0, 55, 0)
-        selection_x_end += 1;
-#endif
-        vte_terminal_select_text(vte, 0,
-                                 std::min(select->begin_row, cursor_row),
-                                 selection_x_end,
-                                 std::max(select->begin_row, cursor_row));
+        range = {vte, 0, logical_line(vte, &select->rows, std::min(select->begin_row, cursor_row)).first,
+                 n_columns - 1,
+                 logical_line(vte, &select->rows, std::max(select->begin_row, cursor_row)).second,
+                 false};
     } else if (select->mode == vi_mode::visual_block) {
-        selection_x_end = std::max(select->begin_col, cursor_col);
+        range = {vte, std::min(select->begin_col, cursor_col), std::min(select->begin_row, cursor_row),
+                 std::max(select->begin_col, cursor_col), std::max(select->begin_row, cursor_row),
+                 true};
+    }
+
+    long selection_x_end = range.end_col;
 #if VTE_CHECK_VERSION(0, 55, 0)
-        selection_x_end += 1;
+    selection_x_end += 1;
 #endif
-        vte_terminal_select_text(vte,
-                                 std::min(select->begin_col, cursor_col),
-                                 std::min(select->begin_row, cursor_row),
-                                 selection_x_end,
-                                 std::max(select->begin_row, cursor_row));
+    // VTE copies the whole selection to PRIMARY here, so the time it takes limits how often
+    // this runs to keep large selections from taking over the main loop
+    const gint64 start = g_get_monotonic_time();
+    vte_terminal_select_text(vte, range.col, range.row, selection_x_end, range.end_row);
+    const gint64 now = g_get_monotonic_time();
+    select->next_apply = now + 4 * (now - start);
+}
+
+static gboolean selection_tick_cb(GtkWidget *widget, GdkFrameClock *, gpointer data) {
+    select_info *select = static_cast<select_info *>(data);
+    if (g_get_monotonic_time() < select->next_apply) {
+        return G_SOURCE_CONTINUE;
     }
+    select->tick = 0;
+    apply_selection(VTE_TERMINAL(widget), select);
+    return G_SOURCE_REMOVE;
+}
 
-    vte_terminal_copy_primary(vte);
+// Motions only mark the selection as changed, so a burst of key repeats results in a single
+// update per frame, or fewer when the selection is slow to copy.
+static void update_selection(VteTerminal *vte, select_info *select) {
+    if (!select->tick) {
+        select->tick = gtk_widget_add_tick_callback(GTK_WIDGET(vte), selection_tick_cb, select,
+                                                    nullptr);
+    }
+}
+
+// Apply a pending update before anything reads or replaces the selection.
+static void flush_selection(VteTerminal *vte, select_info *select) {
+    if (select->tick) {
+        gtk_widget_remove_tick_callback(GTK_WIDGET(vte), select->tick);
+        select->tick = 0;
+        apply_selection(vte, select);
+    }
+}
+
+// Copying a selection made in selection mode only records its bounds. Anything else, such as
+// a mouse selection or a search match, is copied by VTE.
+static void copy_clipboard(VteTerminal *vte, select_info *select) {
+    flush_selection(vte, select);
+    const bool visual = select->mode == vi_mode::visual || select->mode == vi_mode::visual_line ||
+                        select->mode == vi_mode::visual_block;
+    if (!visual || !vte_terminal_get_has_selection(vte)) {
+#if VTE_CHECK_VERSION(0, 50, 0)
+        vte_terminal_copy_clipboard_format(vte, VTE_FORMAT_TEXT);
+#else
+        vte_terminal_copy_clipboard(vte);
+#endif
+        return;
+    }
+    if (!scrollback_unbounded(vte)) {
+        // any burst of output can push the rows out of a bounded history
+        auto text = make_unique(selection_text(select->range), g_free);
+        gtk_clipboard_set_text(gtk_widget_get_clipboard(GTK_WIDGET(vte), GDK_SELECTION_CLIPBOARD),
+                               text.get(), -1);
+        return;
+    }
+
+    // the rows on the screen can change with the next output
+    copied_selection copied{select->range, std::string(), vte_terminal_get_column_count(vte),
+                            last_row(vte)};
+    selection_range &range = copied.range;
+    const long history_end = last_row(vte) + 1 - vte_terminal_get_row_count(vte);
+    if (range.end_row >= history_end) {
+        selection_range part = range;
+        if (history_end > range.row) {
+            part.row = history_end;
+            part.col = range.block ? range.col : 0;
+        }
+        auto text = make_unique(selection_text(part), g_free);
+        copied.tail = text.get();
+        range.end_row = part.row - 1;
+        range.end_col = range.block ? range.end_col : copied.columns - 1;
+    }
+
+    select->clipboard = std::move(copied);
+    if (!select->owns_clipboard) {
+        select->owns_clipboard = claim_selection(vte, GDK_SELECTION_CLIPBOARD, clipboard_get_cb,
+                                                 clipboard_clear_cb, select);
+    }
 }
 
 static void enter_command_mode(VteTerminal *vte, select_info *select) {
@@ -496,6 +1312,10 @@ static void enter_command_mode(VteTerminal *vte, select_info *select) {
 }
 
 static void exit_command_mode(VteTerminal *vte, select_info *select) {
+    if (select->tick) {
+        gtk_widget_remove_tick_callback(GTK_WIDGET(vte), select->tick);
+        select->tick = 0;
+    }
     vte_terminal_set_cursor_position(vte, select->origin_col, select->origin_row);
     vte_terminal_connect_pty_read(vte);
     vte_terminal_unselect_all(vte);
@@ -595,96 +1415,186 @@ static void open_selection(char *browser, VteTerminal *vte) {
     }
 }
 
-static std::unique_ptr<char, decltype(&g_free)>
-get_text_range(VteTerminal *vte, long start_row, long start_col, long end_row, long end_col) {
-    return {vte_terminal_get_text_range(vte, start_row, start_col, end_row, end_col,
-                                        nullptr, nullptr, nullptr), g_free};
-}
+static void scan_url_line(VteTerminal *vte, cached_regex *regex, url_line *line, long end_row) {
+    GArray *attributes = g_array_new(FALSE, FALSE, sizeof(VteCharAttributes));
+    auto content = make_unique(vte_terminal_get_text_range(vte, line->row, 0, end_row,
+                                                           vte_terminal_get_column_count(vte) - 1,
+                                                           nullptr, nullptr, attributes),
+                               g_free);
+    if (!content) {
+        g_array_free(attributes, TRUE);
+        return;
+    }
 
-static bool is_word_char(gunichar c) {
-    static const char *word_char_ascii_punct = "-,./?%&#_=+@~";
-    return g_unichar_isgraph(c) &&
-           (g_unichar_isalnum(c) || (g_unichar_ispunct(c) &&
-                                     (c >= 0x80 || strchr(word_char_ascii_punct, (int)c) != NULL)));
-}
+    const char *text = content.get();
+    const PCRE2_SIZE length = strcspn(text, "\n");
+    PCRE2_SIZE offset = 0;
+    int rc;
 
-template<typename F>
-static void move_backward(VteTerminal *vte, select_info *select, F is_word) {
-    long cursor_col, cursor_row;
-    vte_terminal_get_cursor_position(vte, &cursor_col, &cursor_row);
+    while ((rc = pcre2_match(regex->code, (PCRE2_SPTR)text, length, offset,
+                             PCRE2_NOTEMPTY, regex->match_data, nullptr)) > 0) {
+        const PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(regex->match_data);
+        const auto attr = g_array_index(attributes, VteCharAttributes, ovector[0]);
 
-    auto content = get_text_range(vte, cursor_row, 0, cursor_row, cursor_col);
+        line->matches.push_back({std::string(text + ovector[0], ovector[1] - ovector[0]),
+                                 attr.column, attr.row});
+        offset = ovector[1];
+    }
 
-    if (!content) {
-        return;
+    if (rc < 0 && rc != PCRE2_ERROR_NOMATCH) {
+        PCRE2_UCHAR message[256];
+        pcre2_get_error_message(rc, message, sizeof(message));
+        g_printerr("error while matching: %s\n", (char *)message);
     }
+    g_array_free(attributes, TRUE);
+}
 
-    long length;
-    gunichar *codepoints = g_utf8_to_ucs4(content.get(), -1, nullptr, &length, nullptr);
+static void update_url_index(VteTerminal *vte, url_index *index) {
+    if (!index->dirty) {
+        return;
+    }
 
-    if (!codepoints) {
+    cached_regex *regex = get_pcre_regex(url_regex, PCRE2_CASELESS);
+    if (!regex) {
         return;
     }
 
-    bool in_word = false;
+    const long columns = vte_terminal_get_column_count(vte);
+    if (columns != index->columns) {
+        index->lines.clear(); // rows are rewrapped
+        index->columns = columns;
+    }
 
-    for (long i = length - 2; i > 0; i--) {
-        cursor_col--;
-        if (!is_word(codepoints[i - 1])) {
-            if (in_word) {
+    std::map<long, url_line> previous;
+    for (url_line &line : index->lines) {
+        previous.emplace(line.row, std::move(line));
+    }
+    index->lines.clear();
+
+    // The text is read again without attributes, which is cheap next to matching, and the
+    // attributes are only needed to place the matches of lines that are scanned.
+    const long bottom = bottom_row(vte);
+    for (long row = top_row(vte); row <= bottom; ) {
+        url_line line{row, row, std::string(), std::vector<url_match>()};
+
+        // join soft wrapped rows into one logical line
+        for (; row <= bottom; row++) {
+            auto content = get_text_range(vte, row, 0, row, columns - 1);
+            if (content) {
+                line.text += content.get();
+            }
+            if (!content || (!line.text.empty() && line.text.back() == '\n')) {
+                row++;
                 break;
             }
-        } else {
-            in_word = true;
         }
+
+        line.end_row = row - 1;
+        auto cached = previous.find(line.row);
+        if (cached != previous.end() && cached->second.end_row == line.end_row &&
+            cached->second.text == line.text) {
+            line.matches = std::move(cached->second.matches);
+        } else if (!line.text.empty()) {
+            scan_url_line(vte, regex, &line, row - 1);
+        }
+        index->lines.push_back(std::move(line));
     }
-    vte_terminal_set_cursor_position(vte, cursor_col, cursor_row);
-    update_selection(vte, select);
+    index->dirty = false;
+}
 
-    g_free(codepoints);
+static void find_urls(VteTerminal *vte, search_panel_info *panel_info) {
+    update_url_index(vte, &panel_info->urls);
+
+    const long top = top_row(vte);
+    for (const url_line &line : panel_info->urls.lines) {
+        for (const url_match &match : line.matches) {
+            panel_info->url_list.emplace_back(g_strdup(match.url.c_str()), match.col,
+                                              match.row - top);
+        }
+    }
 }
 
-static void move_backward_word(VteTerminal *vte, select_info *select) {
-    move_backward(vte, select, is_word_char);
+static void invalidate_url_index(search_panel_info *panel_info) {
+    panel_info->urls.dirty = true;
 }
 
-static void move_backward_blank_word(VteTerminal *vte, select_info *select) {
-    move_backward(vte, select, std::not1(std::ref(g_unichar_isspace)));
+static bool is_word_char(gunichar c) {
+    static const char *word_char_ascii_punct = "-,./?%&#_=+@~";
+    return g_unichar_isgraph(c) &&
+           (g_unichar_isalnum(c) || (g_unichar_ispunct(c) &&
+                                     (c >= 0x80 || strchr(word_char_ascii_punct, (int)c) != NULL)));
 }
 
 template<typename F>
-void move_first(VteTerminal *vte, select_info *select, F is_match) {
+static void move_backward(VteTerminal *vte, select_info *select, F is_word, long count) {
     long cursor_col, cursor_row;
     vte_terminal_get_cursor_position(vte, &cursor_col, &cursor_row);
 
-    const long end_col = vte_terminal_get_column_count(vte) - 1;
-
-    auto content = get_text_range(vte, cursor_row, cursor_col, cursor_row, end_col);
+    row_cache *cache = &select->rows;
+    text_position pos{cursor_row, codepoint_at(decode_row(vte, cache, cursor_row), cursor_col)};
+    bool moved = false;
 
-    if (!content) {
-        return;
+    for (long i = 0; i < count; i++) {
+        text_position prev = pos;
+        bool in_word = false, stepped = false;
+        while (prev_position(vte, cache, &prev)) {
+            if (!is_word(char_at(vte, cache, prev))) {
+                if (in_word) {
+                    break;
+                }
+            } else {
+                in_word = true;
+            }
+            pos = prev;
+            stepped = true;
+        }
+        if (!stepped) {
+            break;
+        }
+        moved = true;
+    }
+    if (moved) {
+        set_cursor_position(vte, cache, pos);
+        update_scroll(vte);
+        update_selection(vte, select);
     }
+}
 
-    long length;
-    gunichar *codepoints = g_utf8_to_ucs4(content.get(), -1, nullptr, &length, nullptr);
+static void move_backward_word(VteTerminal *vte, select_info *select, long count) {
+    move_backward(vte, select, is_word_char, count);
+}
 
-    if (!codepoints) {
-        return;
-    }
+static void move_backward_blank_word(VteTerminal *vte, select_info *select, long count) {
+    move_backward(vte, select, std::not1(std::ref(g_unichar_isspace)), count);
+}
 
-    auto iter = std::find_if(codepoints, codepoints + length, is_match);
-    if (iter != codepoints + length) {
-        vte_terminal_set_cursor_position(vte, iter - codepoints, cursor_row);
-        update_selection(vte, select);
+template<typename F>
+void move_first(VteTerminal *vte, select_info *select, F is_match) {
+    long cursor_col, cursor_row;
+    vte_terminal_get_cursor_position(vte, &cursor_col, &cursor_row);
+
+    row_cache *cache = &select->rows;
+    const decoded_row &row = decode_row(vte, cache, cursor_row);
+    text_position pos{cursor_row, codepoint_at(row, cursor_col)};
+    if (pos.index >= (long)row.codepoints.size()) {
+        return;
     }
 
-    g_free(codepoints);
+    do {
+        if (is_match(char_at(vte, cache, pos))) {
+            set_cursor_position(vte, cache, pos);
+            update_scroll(vte);
+            update_selection(vte, select);
+            return;
+        }
+    } while (next_position(vte, cache, &pos));
 }
 
-static void set_cursor_column(VteTerminal *vte, const select_info *select, long column) {
+static void move_to_bol(VteTerminal *vte, select_info *select) {
     long cursor_row;
     vte_terminal_get_cursor_position(vte, nullptr, &cursor_row);
-    vte_terminal_set_cursor_position(vte, column, cursor_row);
+    vte_terminal_set_cursor_position(vte, 0, logical_line(vte, &select->rows, cursor_row).first);
+    update_scroll(vte);
     update_selection(vte, select);
 }
 
@@ -692,93 +1602,71 @@ static void move_to_eol(VteTerminal *vte, select_info *select) {
     long cursor_row;
     vte_terminal_get_cursor_position(vte, nullptr, &cursor_row);
 
-    const long end_col = vte_terminal_get_column_count(vte) - 1;
-
-    auto content = get_text_range(vte, cursor_row, 0, cursor_row, end_col);
-
-    if (!content) {
-        return;
-    }
-
-    long length;
-    gunichar *codepoints = g_utf8_to_ucs4(content.get(), -1, nullptr, &length, nullptr);
-
-    if (!codepoints) {
-        return;
-    }
-
-    auto iter = std::find(codepoints, codepoints + length, '\n');
-    set_cursor_column(vte, select, std::max(iter - codepoints - 1l, 0l));
-
-    g_free(codepoints);
+    const long end_row = logical_line(vte, &select->rows, cursor_row).second;
+    const decoded_row &row = decode_row(vte, &select->rows, end_row);
+    vte_terminal_set_cursor_position(vte, row.columns.empty() ? 0 : row.columns.back(), end_row);
+    update_scroll(vte);
+    update_selection(vte, select);
 }
 
 template<typename F>
-static void move_forward(VteTerminal *vte, select_info *select, F is_word, bool goto_word_end) {
+static void move_forward(VteTerminal *vte, select_info *select, F is_word, bool goto_word_end,
+                         long count) {
     long cursor_col, cursor_row;
     vte_terminal_get_cursor_position(vte, &cursor_col, &cursor_row);
 
-    const long end_col = vte_terminal_get_column_count(vte) - 1;
-
-    auto content = get_text_range(vte, cursor_row, cursor_col, cursor_row, end_col);
-
-    if (!content) {
-        return;
-    }
-
-    long length;
-    gunichar *codepoints = g_utf8_to_ucs4(content.get(), -1, nullptr, &length, nullptr);
-
-    if (!codepoints) {
+    row_cache *cache = &select->rows;
+    const decoded_row &row = decode_row(vte, cache, cursor_row);
+    text_position pos{cursor_row, codepoint_at(row, cursor_col)};
+    if (pos.index >= (long)row.codepoints.size()) {
         return;
     }
 
-    // prevent going past the end (get_text_range adds a \n)
-    if (codepoints[length - 1] == '\n') {
-        length--;
-    }
-
-    bool end_of_word = false;
-
-    if (!goto_word_end) {
-        for (long i = 1; i < length; i++) {
-            if (is_word(codepoints[i - 1])) {
-                if (end_of_word) {
+    for (long i = 0; i < count; i++) {
+        const text_position start = pos;
+        if (!goto_word_end) {
+            bool end_of_word = false;
+            do {
+                if (is_word(char_at(vte, cache, pos))) {
+                    if (end_of_word) {
+                        break;
+                    }
+                } else {
+                    end_of_word = true;
+                }
+            } while (next_position(vte, cache, &pos));
+        } else {
+            while (next_position(vte, cache, &pos)) {
+                text_position next = pos;
+                if (is_word(char_at(vte, cache, pos)) &&
+                    (!next_position(vte, cache, &next) || !is_word(char_at(vte, cache, next)))) {
                     break;
                 }
-            } else {
-                end_of_word = true;
             }
-            cursor_col++;
         }
-    } else {
-        for (long i = 2; i <= length; i++) {
-            cursor_col++;
-            if (is_word(codepoints[i - 1]) && !is_word(codepoints[i])) {
-                break;
-            }
+        if (pos.row == start.row && pos.index == start.index) {
+            break;
         }
     }
-    vte_terminal_set_cursor_position(vte, cursor_col, cursor_row);
+    set_cursor_position(vte, cache, pos);
+    update_scroll(vte);
     update_selection(vte, select);
-
-    g_free(codepoints);
 }
 
-static void move_forward_end_word(VteTerminal *vte, select_info *select) {
-    move_forward(vte, select, is_word_char, true);
+static void move_forward_end_word(VteTerminal *vte, select_info *select, long count) {
+    move_forward(vte, select, is_word_char, true, count);
 }
 
-static void move_forward_end_blank_word(VteTerminal *vte, select_info *select) {
-    move_forward(vte, select, std::not1(std::ref(g_unichar_isspace)), true);
+static void move_forward_end_blank_word(VteTerminal *vte, select_info *select, long count) {
+    move_forward(vte, select, std::not1(std::ref(g_unichar_isspace)), true, count);
 }
 
-static void move_forward_word(VteTerminal *vte, select_info *select) {
-    move_forward(vte, select, is_word_char, false);
+static void move_forward_word(VteTerminal *vte, select_info *select, long count) {
+    move_forward(vte, select, is_word_char, false, count);
 }
 
-static void move_forward_blank_word(VteTerminal *vte, select_info *select) {
-    move_forward(vte, select, std::not1(std::ref(g_unichar_isspace)), false);
+static void move_forward_blank_word(VteTerminal *vte, select_info *select, long count) {
+    move_forward(vte, select, std::not1(std::ref(g_unichar_isspace)), false, count);
 }
 
 /* {{{ CALLBACKS */
@@ -822,6 +1710,320 @@ gboolean window_state_cb(GtkWindow *, GdkEventWindowState *event, keybind_info *
     return FALSE;
 }
 
+/* {{{ SCROLLBACK BUDGET */
+static const guint scrollback_check_seconds = 5;
+static const long scrollback_sample_rows = 32;
+static const long scrollback_min_lines = 1000;
+static const long vte_default_scrollback = 512;
+static const double row_overhead = 16; // the row record and its attribute runs
+
+// VTE keeps the history compressed in temporary files and reports no sizes, so the bytes held
+// per row are estimated from the text of rows spread over the history.
+static void measure_scrollback(VteTerminal *vte, scrollback_usage *usage) {
+    const long first = first_row(vte);
+    const long end = last_row(vte) + 1 - vte_terminal_get_row_count(vte);
+    usage->rows = std::max(end - first, 0l);
+    usage->row_bytes = 0;
+    if (!usage->rows) {
+        return;
+    }
+
+    const long columns = vte_terminal_get_column_count(vte);
+    const long step = std::max(usage->rows / scrollback_sample_rows, 1l);
+    size_t bytes = 0;
+    long sampled = 0;
+    for (long row = first; row < end && sampled < scrollback_sample_rows; row += step, sampled++) {
+        if (auto text = get_text_range(vte, row, 0, row, columns - 1)) {
+            bytes += strlen(text.get());
+        }
+    }
+    usage->row_bytes = (double)bytes / (double)sampled + row_overhead;
+}
+
+// the deleted temporary files held open by the process, where VTE spills the history of every
+// terminal without saying which file belongs to which
+static gint64 scrollback_spill() {
+    GDir *dir = g_dir_open("/proc/self/fd", 0, nullptr);
+    if (!dir) {
+        return 0;
+    }
+    const std::string tmp = g_get_tmp_dir();
+    gint64 total = 0;
+    while (const char *name = g_dir_read_name(dir)) {
+        const std::string path = std::string("/proc/self/fd/") + name;
+        auto target = make_unique(g_file_read_link(path.c_str(), nullptr), g_free);
+        struct stat st;
+        if (target && g_str_has_prefix(target.get(), tmp.c_str()) &&
+            g_str_has_suffix(target.get(), " (deleted)") &&
+            !stat(path.c_str(), &st) && S_ISREG(st.st_mode)) {
+            total += (gint64)st.st_blocks * 512;
+        }
+    }
+    g_dir_close(dir);
+    return total;
+}
+
+// the "some" share of the last 10 seconds in which tasks stalled on memory, as a percentage
+static maybe<double> memory_pressure() {
+    char *contents;
+    if (!g_file_get_contents("/proc/pressure/memory", &contents, nullptr, nullptr)) {
+        return {};
+    }
+    double avg10;
+    const bool parsed = sscanf(contents, "some avg10=%lf", &avg10) == 1;
+    g_free(contents);
+    if (!parsed) {
+        return {};
+    }
+    return avg10;
+}
+
+// negative limits are unbounded
+static long min_limit(long a, long b) {
+    if (a < 0) {
+        return b;
+    }
+    return b < 0 ? a : std::min(a, b);
+}
+
+// Lowering the line limit is the only way to have VTE drop the oldest rows, so the budget
+// becomes a limit on lines from the estimated row size. Half of the history is dropped once per
+// episode of memory pressure, which only ends when it falls below half the threshold, as the
+// 10 second average takes a while to reflect the memory freed.
+static bool scrollback_budgeted(const config_snapshot *cfg) {
+    return cfg && (cfg->scrollback_bytes > 0 || cfg->memory_pressure > 0);
+}
+
+static void enforce_scrollback_budget(keybind_info *info, const maybe<double> &pressure) {
+    const config_snapshot *cfg = info->config.applied.get();
+    if (!cfg) {
+        return;
+    }
+    scrollback_usage &usage = info->scrollback;
+    const long configured = cfg->scrollback_lines ? *cfg->scrollback_lines : vte_default_scrollback;
+    if (configured != usage.configured) {
+        usage.configured = usage.limit = configured; // set by the config
+    }
+    if (!scrollback_budgeted(cfg)) {
+        usage.pressured = false;
+        if (usage.limit != configured) {
+            release_clipboard(&info->select, false);
+            vte_terminal_set_scrollback_lines(info->vte, configured);
+            usage.limit = configured;
+        }
+        return;
+    }
+    measure_scrollback(info->vte, &usage);
+
+    long limit = configured;
+    if (cfg->scrollback_bytes > 0 && usage.row_bytes > 0) {
+        limit = min_limit(limit, std::max((long)((double)cfg->scrollback_bytes / usage.row_bytes),
+                                          scrollback_min_lines));
+    }
+    const double threshold = cfg->memory_pressure;
+    if (!usage.pressured && threshold > 0 && pressure && *pressure >= threshold) {
+        usage.pressured = true;
+        usage.pressure_limit = std::max(usage.rows / 2, scrollback_min_lines);
+    } else if (usage.pressured && (threshold <= 0 || !pressure || *pressure < threshold / 2)) {
+        usage.pressured = false;
+    }
+    if (usage.pressured) {
+        limit = min_limit(limit, usage.pressure_limit);
+    }
+    if (limit != usage.limit) {
+        release_clipboard(&info->select, false);
+        vte_terminal_set_scrollback_lines(info->vte, limit);
+        usage.limit = limit;
+    }
+}
+
+static gboolean check_scrollback_cb(gpointer) {
+    const maybe<double> pressure = memory_pressure();
+    for (window_info *win : windows) {
+        enforce_scrollback_budget(&win->keybind, pressure);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void append_scrollback_stats(GString *out) {
+    g_string_append_printf(out, "{\"spill_bytes\": %" G_GINT64_FORMAT ", \"terminals\": [",
+                           scrollback_spill());
+    bool first = true;
+    for (window_info *win : windows) {
+        scrollback_usage &usage = win->keybind.scrollback;
+        measure_scrollback(win->keybind.vte, &usage);
+        g_string_append_printf(out, "%s{\"rows\": %ld, \"estimated_bytes\": %.0f, "
+                               "\"limit_lines\": %ld}", first ? "" : ", ", usage.rows,
+                               usage.row_bytes * (double)usage.rows, usage.limit);
+        first = false;
+    }
+    g_string_append(out, "]}");
+}
+
+// Each check samples the rows of every terminal, so it only runs while one has a budget. The
+// limits of terminals whose budget was just removed are restored before it stops.
+static void update_scrollback_budget() {
+    static guint timer = 0;
+    bool budgeted = false;
+    for (window_info *win : windows) {
+        budgeted = budgeted || scrollback_budgeted(win->keybind.config.applied.get());
+    }
+    if (budgeted && !timer) {
+        timer = g_timeout_add_seconds(scrollback_check_seconds, check_scrollback_cb, nullptr);
+    } else if (!budgeted && timer) {
+        check_scrollback_cb(nullptr);
+        g_source_remove(timer);
+        timer = 0;
+    }
+}
+/* }}} */
+
+/* {{{ LATENCY */
+// Log-linear buckets of microseconds: exact below 16, then 16 per power of two, which keeps
+// every bucket within about 6% of the values in it.
+static const unsigned latency_sub_buckets = 16;
+static const unsigned latency_max_exponent = 36;
+static const gint64 latency_timeout = G_USEC_PER_SEC;
+
+struct latency_histogram {
+    std::array<uint64_t, latency_sub_buckets * (latency_max_exponent - 2)> counts;
+    uint64_t total;
+    gint64 max;
+};
+
+static std::array<latency_histogram, 3> latency_histograms;
+
+static size_t latency_bucket(gint64 value) {
+    if (value < (gint64)latency_sub_buckets) {
+        return (size_t)std::max(value, (gint64)0);
+    }
+    const unsigned exponent = std::min((unsigned)g_bit_storage((gulong)value) - 1,
+                                       latency_max_exponent);
+    const unsigned shift = exponent - 4;
+    const size_t sub = (size_t)std::min(value >> shift, (gint64)latency_sub_buckets * 2 - 1);
+    return latency_sub_buckets * (exponent - 3) + sub - latency_sub_buckets;
+}
+
+// the largest value counted in a bucket
+static gint64 latency_bucket_limit(size_t bucket) {
+    if (bucket < latency_sub_buckets) {
+        return (gint64)bucket;
+    }
+    const unsigned shift = (unsigned)(bucket / latency_sub_buckets) - 1;
+    const gint64 sub = (gint64)(bucket % latency_sub_buckets + latency_sub_buckets);
+    return ((sub + 1) << shift) - 1;
+}
+
+static void record_latency(latency_path path, gint64 value) {
+    latency_histogram &histogram = latency_histograms[(size_t)path];
+    histogram.counts[latency_bucket(value)]++;
+    histogram.total++;
+    histogram.max = std::max(histogram.max, value);
+}
+
+static gint64 latency_percentile(const latency_histogram &histogram, double percentile) {
+    const uint64_t target = (uint64_t)std::ceil((double)histogram.total * percentile / 100);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < histogram.counts.size(); i++) {
+        seen += histogram.counts[i];
+        if (seen && seen >= target) {
+            return std::min(latency_bucket_limit(i), histogram.max);
+        }
+    }
+    return 0;
+}
+
+static void dump_latency_stats() {
+    static const char *const names[] = {"insert", "selection", "overlay"};
+    static const std::pair<const char *, double> percentiles[] = {
+        {"p50", 50}, {"p90", 90}, {"p99", 99}, {"p999", 99.9}
+    };
+    GString *out = g_string_new("{\"latency\": {");
+    for (size_t path = 0; path < latency_histograms.size(); path++) {
+        const latency_histogram &histogram = latency_histograms[path];
+        g_string_append_printf(out, "%s\"%s\": {\"count\": %" G_GUINT64_FORMAT,
+                               path ? ", " : "", names[path], histogram.total);
+        for (const auto &percentile : percentiles) {
+            g_string_append_printf(out, ", \"%s_us\": %" G_GINT64_FORMAT, percentile.first,
+                                   latency_percentile(histogram, percentile.second));
+        }
+        g_string_append_printf(out, ", \"max_us\": %" G_GINT64_FORMAT ", \"buckets\": [",
+                               histogram.max);
+        bool first = true;
+        for (size_t i = 0; i < histogram.counts.size(); i++) {
+            if (histogram.counts[i]) {
+                g_string_append_printf(out, "%s[%" G_GINT64_FORMAT ", %" G_GUINT64_FORMAT "]",
+                                       first ? "" : ", ", latency_bucket_limit(i),
+                                       histogram.counts[i]);
+                first = false;
+            }
+        }
+        g_string_append(out, "]}");
+    }
+    g_string_append(out, "}, \"scrollback\": ");
+    append_scrollback_stats(out);
+    g_string_append_printf(out, ", \"reclaimed_bytes\": %zu}\n", reclaimed_bytes);
+
+    GError *error = nullptr;
+    if (!g_file_set_contents(stats_file, out->str, (gssize)out->len, &error)) {
+        g_printerr("failed to write %s: %s\n", stats_file, error->message);
+        g_error_free(error);
+    }
+    g_string_free(out, TRUE);
+}
+
+static gboolean dump_latency_cb(gpointer) {
+    dump_latency_stats();
+    return G_SOURCE_CONTINUE;
+}
+
+// Key presses handled by the child only show up once it has written its output, anything
+// else is drawn in the next frame.
+static void start_latency_probe(keybind_info *info, latency_path path, bool waiting_output) {
+    latency_probe &probe = info->latency;
+    const gint64 now = g_get_monotonic_time();
+    if ((probe.waiting_output || probe.waiting_paint) && now - probe.key_time < latency_timeout) {
+        return;
+    }
+    probe.key_time = now;
+    probe.path = path;
+    probe.waiting_output = waiting_output;
+    probe.waiting_paint = !waiting_output;
+}
+
+static void latency_output_cb(keybind_info *info) {
+    latency_probe &probe = info->latency;
+    if (probe.waiting_output) {
+        probe.waiting_output = false;
+        probe.waiting_paint = g_get_monotonic_time() - probe.key_time < latency_timeout;
+    }
+}
+
+static void latency_after_paint_cb(GdkFrameClock *, keybind_info *info) {
+    latency_probe &probe = info->latency;
+    if (probe.waiting_paint) {
+        probe.waiting_paint = false;
+        record_latency(probe.path, g_get_monotonic_time() - probe.key_time);
+    }
+}
+
+static void watch_latency(keybind_info *info) {
+    latency_probe &probe = info->latency;
+    probe.clock = gtk_widget_get_frame_clock(GTK_WIDGET(info->window));
+    probe.paint_handler = g_signal_connect_swapped(probe.clock, "after-paint",
+                                                   G_CALLBACK(latency_after_paint_cb), info);
+    g_signal_connect_swapped(info->vte, "contents-changed", G_CALLBACK(latency_output_cb), info);
+    g_signal_connect_swapped(info->vte, "cursor-moved", G_CALLBACK(latency_output_cb), info);
+}
+
+// Also written on the way out, through quit_process, while the windows can still be measured.
+static void setup_latency_stats() {
+    if (stats_file) {
+        g_unix_signal_add(SIGUSR2, dump_latency_cb, nullptr);
+    }
+}
+/* }}} */
+
 gboolean key_press_cb(VteTerminal *vte, GdkEventKey *event, keybind_info *info) {
     const guint modifiers = event->state & gtk_accelerator_get_default_mod_mask();
 
@@ -831,34 +2033,49 @@ gboolean key_press_cb(VteTerminal *vte, GdkEventKey *event, keybind_info *info)
     }
 
     if (info->select.mode != vi_mode::insert) {
+        if (event->is_modifier) {
+            return TRUE; // don't drop a count typed before shift
+        }
+        // vim style count prefix, applied in one step by the following motion
+        if (!modifiers && ((event->keyval >= GDK_KEY_1 && event->keyval <= GDK_KEY_9) ||
+                           (event->keyval == GDK_KEY_0 && info->select.count))) {
+            info->select.count = std::min(info->select.count * 10 + (long)(event->keyval - GDK_KEY_0),
+                                          99999999l);
+            return TRUE;
+        }
+        const long count = std::max(info->select.count, 1l);
+        info->select.count = 0;
+        start_latency_probe(info, latency_path::selection, false);
+
         if (modifiers == GDK_CONTROL_MASK) {
             switch (gdk_keyval_to_lower(event->keyval)) {
                 case GDK_KEY_bracketleft:
                     exit_command_mode(vte, &info->select);
-                    gtk_widget_hide(info->panel.da);
-                    gtk_widget_hide(info->panel.entry);
+                    cancel_search(&info->panel.search);
+                    hide_overlay_widget(info->panel.da);
+                    hide_overlay_widget(info->panel.entry);
                     info->panel.url_list.clear();
                     break;
                 case GDK_KEY_v:
                     toggle_visual(vte, &info->select, vi_mode::visual_block);
                     break;
                 case GDK_KEY_Left:
-                    move_backward_blank_word(vte, &info->select);
+                    move_backward_blank_word(vte, &info->select, count);
                     break;
                 case GDK_KEY_Right:
-                    move_forward_blank_word(vte, &info->select);
+                    move_forward_blank_word(vte, &info->select, count);
                     break;
                 case GDK_KEY_u:
-                    move(vte, &info->select, 0, -(vte_terminal_get_row_count(vte) / 2));
+                    move(vte, &info->select, 0, -count * (vte_terminal_get_row_count(vte) / 2));
                     break;
                 case GDK_KEY_d:
-                    move(vte, &info->select, 0, vte_terminal_get_row_count(vte) / 2);
+                    move(vte, &info->select, 0, count * (vte_terminal_get_row_count(vte) / 2));
                     break;
                 case GDK_KEY_b:
-                    move(vte, &info->select, 0, -(vte_terminal_get_row_count(vte) - 1));
+                    move(vte, &info->select, 0, -count * (vte_terminal_get_row_count(vte) - 1));
                     break;
                 case GDK_KEY_f:
-                    move(vte, &info->select, 0, vte_terminal_get_row_count(vte) - 1);
+                    move(vte, &info->select, 0, count * (vte_terminal_get_row_count(vte) - 1));
                     break;
             }
             return TRUE;
@@ -866,10 +2083,10 @@ gboolean key_press_cb(VteTerminal *vte, GdkEventKey *event, keybind_info *info)
         if (modifiers == GDK_SHIFT_MASK) {
             switch (event->keyval) {
                 case GDK_KEY_Left:
-                    move_backward_word(vte, &info->select);
+                    move_backward_word(vte, &info->select, count);
                     return TRUE;
                 case GDK_KEY_Right:
-                    move_forward_word(vte, &info->select);
+                    move_forward_word(vte, &info->select, count);
                     return TRUE;
             }
         }
@@ -877,50 +2094,51 @@ gboolean key_press_cb(VteTerminal *vte, GdkEventKey *event, keybind_info *info)
             case GDK_KEY_Escape:
             case GDK_KEY_q:
                 exit_command_mode(vte, &info->select);
-                gtk_widget_hide(info->panel.da);
-                gtk_widget_hide(info->panel.entry);
+                cancel_search(&info->panel.search);
+                hide_overlay_widget(info->panel.da);
+                hide_overlay_widget(info->panel.entry);
                 info->panel.url_list.clear();
                 break;
             case GDK_KEY_Left:
             case GDK_KEY_h:
-                move(vte, &info->select, -1, 0);
+                move(vte, &info->select, -count, 0);
                 break;
             case GDK_KEY_Down:
             case GDK_KEY_j:
-                move(vte, &info->select, 0, 1);
+                move(vte, &info->select, 0, count);
                 break;
             case GDK_KEY_Up:
             case GDK_KEY_k:
-                move(vte, &info->select, 0, -1);
+                move(vte, &info->select, 0, -count);
                 break;
             case GDK_KEY_Right:
             case GDK_KEY_l:
-                move(vte, &info->select, 1, 0);
+                move(vte, &info->select, count, 0);
                 break;
             case GDK_KEY_b:
-                move_backward_word(vte, &info->select);
+                move_backward_word(vte, &info->select, count);
                 break;
             case GDK_KEY_B:
-                move_backward_blank_word(vte, &info->select);
+                move_backward_blank_word(vte, &info->select, count);
                 break;
             case GDK_KEY_w:
-                move_forward_word(vte, &info->select);
+                move_forward_word(vte, &info->select, count);
                 break;
             case GDK_KEY_W:
-                move_forward_blank_word(vte, &info->select);
+                move_forward_blank_word(vte, &info->select, count);
                 break;
             case GDK_KEY_e:
-                move_forward_end_word(vte, &info->select);
+                move_forward_end_word(vte, &info->select, count);
                 break;
             case GDK_KEY_E:
-                move_forward_end_blank_word(vte, &info->select);
+                move_forward_end_blank_word(vte, &info->select, count);
                 break;
             case GDK_KEY_0:
             case GDK_KEY_Home:
-                set_cursor_column(vte, &info->select, 0);
+                move_to_bol(vte, &info->select);
                 break;
             case GDK_KEY_asciicircum:
-                set_cursor_column(vte, &info->select, 0);
+                move_to_bol(vte, &info->select);
                 move_first(vte, &info->select, std::not1(std::ref(g_unichar_isspace)));
                 break;
             case GDK_KEY_dollar:
@@ -949,11 +2167,7 @@ gboolean key_press_cb(VteTerminal *vte, GdkEventKey *event, keybind_info *info)
                 toggle_visual(vte, &info->select, vi_mode::visual_line);
                 break;
             case GDK_KEY_y:
-#if VTE_CHECK_VERSION(0, 50, 0)
-                vte_terminal_copy_clipboard_format(vte, VTE_FORMAT_TEXT);
-#else
-                vte_terminal_copy_clipboard(vte);
-#endif
+                copy_clipboard(vte, &info->select);
                 break;
             case GDK_KEY_slash:
                 overlay_show(&info->panel, overlay_mode::search, vte);
@@ -962,36 +2176,45 @@ gboolean key_press_cb(VteTerminal *vte, GdkEventKey *event, keybind_info *info)
                 overlay_show(&info->panel, overlay_mode::rsearch, vte);
                 break;
             case GDK_KEY_n:
-                vte_terminal_search_find_next(vte);
-                vte_terminal_copy_primary(vte);
+                flush_selection(vte, &info->select);
+                search_next(info, false);
                 break;
             case GDK_KEY_N:
-                vte_terminal_search_find_previous(vte);
-                vte_terminal_copy_primary(vte);
+                flush_selection(vte, &info->select);
+                search_next(info, true);
                 break;
             case GDK_KEY_u:
-                search(vte, url_regex, false);
+                flush_selection(vte, &info->select);
+                search(info, url_regex, false);
                 break;
             case GDK_KEY_U:
-                search(vte, url_regex, true);
+                flush_selection(vte, &info->select);
+                search(info, url_regex, true);
                 break;
             case GDK_KEY_o:
+                flush_selection(vte, &info->select);
                 open_selection(info->config.browser, vte);
                 break;
             case GDK_KEY_Return:
+                flush_selection(vte, &info->select);
                 open_selection(info->config.browser, vte);
                 exit_command_mode(vte, &info->select);
+                hide_overlay_widget(info->panel.entry);
                 break;
             case GDK_KEY_x:
                 if (!info->config.browser)
                     break;
                 find_urls(vte, &info->panel);
-                gtk_widget_show(info->panel.da);
+                gtk_widget_show(hint_area(&info->panel));
                 overlay_show(&info->panel, overlay_mode::urlselect, nullptr);
                 break;
         }
         return TRUE;
     }
+    if (info->paste.watch && event->keyval == GDK_KEY_Escape && !modifiers) {
+        cancel_paste(info);
+        return TRUE;
+    }
     if (modifiers == (GDK_CONTROL_MASK|GDK_SHIFT_MASK)) {
         switch (gdk_keyval_to_lower(event->keyval)) {
             case GDK_KEY_plus:
@@ -1010,25 +2233,26 @@ gboolean key_press_cb(VteTerminal *vte, GdkEventKey *event, keybind_info *info)
             case GDK_KEY_x:
                 enter_command_mode(vte, &info->select);
                 find_urls(vte, &info->panel);
-                gtk_widget_show(info->panel.da);
+                gtk_widget_show(hint_area(&info->panel));
                 overlay_show(&info->panel, overlay_mode::urlselect, nullptr);
                 exit_command_mode(vte, &info->select);
                 return TRUE;
             case GDK_KEY_c:
-#if VTE_CHECK_VERSION(0, 50, 0)
-                vte_terminal_copy_clipboard_format(vte, VTE_FORMAT_TEXT);
-#else
-                vte_terminal_copy_clipboard(vte);
-#endif
+                copy_clipboard(vte, &info->select);
                 return TRUE;
             case GDK_KEY_v:
-                vte_terminal_paste_clipboard(vte);
+                paste_clipboard(vte);
                 return TRUE;
             case GDK_KEY_r:
                 reload_config();
                 return TRUE;
             case GDK_KEY_l:
+                release_clipboard(&info->select, false);
                 vte_terminal_reset(vte, TRUE, TRUE);
+                info->panel.tokens.indexed_row = std::numeric_limits<long>::min();
+#if VTE_CHECK_VERSION(0, 68, 0)
+                reset_recorded_paste_mode(vte);
+#endif
                 return TRUE;
             default:
                 if (modify_key_feed(event, info, modify_table))
@@ -1059,6 +2283,9 @@ gboolean key_press_cb(VteTerminal *vte, GdkEventKey *event, keybind_info *info)
                     return TRUE;
         }
     }
+    if (!event->is_modifier) {
+        start_latency_probe(info, latency_path::insert, true);
+    }
     return FALSE;
 }
 
@@ -1082,6 +2309,11 @@ static void synthesize_keypress(GtkWidget *widget, unsigned keyval) {
 gboolean entry_key_press_cb(GtkEntry *entry, GdkEventKey *event, keybind_info *info) {
     const guint modifiers = event->state & gtk_accelerator_get_default_mod_mask();
     gboolean ret = FALSE;
+    std::string pattern;
+
+    if (!event->is_modifier) {
+        start_latency_probe(info, latency_path::overlay, false);
+    }
 
     if (modifiers == GDK_CONTROL_MASK) {
         switch (event->keyval) {
@@ -1093,10 +2325,11 @@ gboolean entry_key_press_cb(GtkEntry *entry, GdkEventKey *event, keybind_info *i
     switch (event->keyval) {
         case GDK_KEY_BackSpace:
             if (info->panel.mode == overlay_mode::urlselect && info->panel.fulltext) {
+                auto previous = make_unique(g_strdup(info->panel.fulltext), g_free);
                 size_t slen = strlen(info->panel.fulltext);
                 if (info->panel.fulltext != nullptr && slen > 0)
                     info->panel.fulltext[slen-1] = '\0';
-                gtk_widget_queue_draw(info->panel.da);
+                queue_marker_redraw(info, previous.get(), info->panel.fulltext);
             }
             break;
         case GDK_KEY_0:
@@ -1112,7 +2345,7 @@ gboolean entry_key_press_cb(GtkEntry *entry, GdkEventKey *event, keybind_info *i
             if (info->panel.mode == overlay_mode::urlselect) {
                 const char *const text = gtk_entry_get_text(entry);
                 size_t len = strlen(text);
-                free(info->panel.fulltext);
+                char *previous = info->panel.fulltext;
                 info->panel.fulltext = g_strndup(text, len + 1);
                 info->panel.fulltext[len] = (char)event->keyval;
                 size_t urld = static_cast<size_t>(info->panel.url_list.size());
@@ -1127,8 +2360,9 @@ gboolean entry_key_press_cb(GtkEntry *entry, GdkEventKey *event, keybind_info *i
                     launch_url(info->config.browser, info->panel.fulltext, &info->panel);
                     ret = TRUE;
                 } else {
-                    gtk_widget_queue_draw(info->panel.da);
+                    queue_marker_redraw(info, previous, info->panel.fulltext);
                 }
+                free(previous);
             }
             break;
         case GDK_KEY_Tab:
@@ -1149,13 +2383,12 @@ gboolean entry_key_press_cb(GtkEntry *entry, GdkEventKey *event, keybind_info *i
 
             switch (info->panel.mode) {
                 case overlay_mode::search:
-                    search(info->vte, text, false);
-                    break;
                 case overlay_mode::rsearch:
-                    search(info->vte, text, true);
+                    // searched once the entry is hidden, as it is reused for the match count
+                    pattern = text;
                     break;
                 case overlay_mode::completion:
-                    vte_terminal_feed_child(info->vte, text, -1);
+                    feed_child_async(info, text, false);
                     break;
                 case overlay_mode::urlselect:
                     launch_url(info->config.browser, text, &info->panel);
@@ -1169,14 +2402,18 @@ gboolean entry_key_press_cb(GtkEntry *entry, GdkEventKey *event, keybind_info *i
 
     if (ret) {
         if (info->panel.mode == overlay_mode::urlselect) {
-            gtk_widget_hide(info->panel.da);
+            hide_overlay_widget(info->panel.da);
             info->panel.url_list.clear();
             free(info->panel.fulltext);
             info->panel.fulltext = nullptr;
         }
+        const bool reverse = info->panel.mode == overlay_mode::rsearch;
         info->panel.mode = overlay_mode::hidden;
-        gtk_widget_hide(info->panel.entry);
+        hide_overlay_widget(info->panel.entry);
         gtk_widget_grab_focus(GTK_WIDGET(info->vte));
+        if (!pattern.empty()) {
+            search(info, pattern.c_str(), reverse);
+        }
     }
     return ret;
 }
@@ -1229,423 +2466,3295 @@ static void bell_cb(GtkWidget *vte, gboolean *urgent_on_bell) {
     }
 }
 
-gboolean focus_cb(GtkWindow *window) {
-    gtk_window_set_urgency_hint(window, FALSE);
-    return FALSE;
-}
 /* }}} */
 
-GtkTreeModel *create_completion_model(VteTerminal *vte) {
-    GtkListStore *store = gtk_list_store_new(1, G_TYPE_STRING);
-
-    long end_row, end_col;
-    vte_terminal_get_cursor_position(vte, &end_col, &end_row);
-    auto content = get_text_range(vte, 0, 0, end_row, end_col);
-
-    if (!content) {
-        g_printerr("no content returned for completion\n");
-        return GTK_TREE_MODEL(store);
-    }
+static const size_t max_token_length = 128;
 
-    auto less = [](const char *a, const char *b) { return strcmp(a, b) < 0; };
-    std::set<const char *, decltype(less)> tokens(less);
-
-    for (char *s_ptr = content.get(), *saveptr; ; s_ptr = nullptr) {
+template<typename F>
+static void for_each_token(char *text, F func) {
+    for (char *s_ptr = text, *saveptr; ; s_ptr = nullptr) {
         const char *token = strtok_r(s_ptr, " \n\t", &saveptr);
         if (!token) {
             break;
         }
-        tokens.insert(token);
-    }
-
-    for (const char *token : tokens) {
-        GtkTreeIter iter;
-        gtk_list_store_append(store, &iter);
-        gtk_list_store_set(store, &iter, 0, token, -1);
+        // long runs without spaces are base64 blobs and the like rather than words
+        if (strlen(token) <= max_token_length) {
+            func(token);
+        }
     }
+}
 
-    return GTK_TREE_MODEL(store);
+static void add_tokens(token_index *index, char *text) {
+    for_each_token(text, [index](const char *token) {
+        auto it = index->tokens.emplace(token, token_stats{0, 0});
+        if (it.second) {
+            index->pending.push_back(&it.first->first);
+        }
+        it.first->second.uses++;
+        it.first->second.last_use = index->generation;
+    });
 }
 
-void search(VteTerminal *vte, const char *pattern, bool reverse) {
-    auto terminal_search = reverse ? vte_terminal_search_find_previous : vte_terminal_search_find_next;
+// Drop the least recently seen tokens, preferring rarely seen ones, down to 7/8 of the limit.
+static void evict_tokens(token_index *index) {
+    if (index->tokens.size() <= index->limit) {
+        return;
+    }
 
-    VteRegex *regex = vte_terminal_search_get_regex(vte);
-    if (regex) vte_regex_unref(regex);
-    vte_terminal_search_set_regex(vte,
-                    vte_regex_new_for_search(pattern,
-                                    (gssize) strlen(pattern),
-                                    PCRE2_MULTILINE | PCRE2_CASELESS,
-                                    nullptr), 0);
+    using token_iter = decltype(index->tokens)::iterator;
+    std::vector<token_iter> candidates;
+    candidates.reserve(index->tokens.size());
+    for (auto it = index->tokens.begin(); it != index->tokens.end(); ++it) {
+        candidates.push_back(it);
+    }
 
-    if (!terminal_search(vte)) {
-        vte_terminal_unselect_all(vte);
-        terminal_search(vte);
+    const size_t n_evict = index->tokens.size() - (index->limit - index->limit / 8);
+    std::nth_element(candidates.begin(), candidates.begin() + (long)n_evict, candidates.end(),
+                     [](const token_iter &a, const token_iter &b) {
+                         return std::make_pair(a->second.last_use, a->second.uses) <
+                                std::make_pair(b->second.last_use, b->second.uses);
+                     });
+
+    std::unordered_set<const std::string *> evicted;
+    for (size_t i = 0; i < n_evict; i++) {
+        evicted.insert(&candidates[i]->first);
     }
+    auto is_evicted = [&](const std::string *token) { return evicted.count(token) != 0; };
+    index->sorted.erase(std::remove_if(index->sorted.begin(), index->sorted.end(), is_evicted),
+                        index->sorted.end());
+    index->pending.erase(std::remove_if(index->pending.begin(), index->pending.end(), is_evicted),
+                         index->pending.end());
+    for (size_t i = 0; i < n_evict; i++) {
+        index->tokens.erase(candidates[i]);
+    }
+}
 
-    vte_terminal_copy_primary(vte);
+static void sort_tokens(token_index *index) {
+    if (index->pending.empty()) {
+        return;
+    }
+    auto less = [](const std::string *a, const std::string *b) { return *a < *b; };
+    std::sort(index->pending.begin(), index->pending.end(), less);
+    const size_t middle = index->sorted.size();
+    index->sorted.insert(index->sorted.end(), index->pending.begin(), index->pending.end());
+    std::inplace_merge(index->sorted.begin(), index->sorted.begin() + (long)middle,
+                       index->sorted.end(), less);
+    index->pending.clear();
 }
 
-void overlay_show(search_panel_info *info, overlay_mode mode, VteTerminal *vte) {
-    if (vte) {
-        GtkEntryCompletion *completion = gtk_entry_completion_new();
-        gtk_entry_set_completion(GTK_ENTRY(info->entry), completion);
-        g_object_unref(completion);
+static void update_token_index(VteTerminal *vte, token_index *index) {
+    static const long chunk_rows = 4096;
 
-        GtkTreeModel *completion_model = create_completion_model(vte);
-        gtk_entry_completion_set_model(completion, completion_model);
-        g_object_unref(completion_model);
+    long cursor_col, cursor_row;
+    vte_terminal_get_cursor_position(vte, &cursor_col, &cursor_row);
+    const long end_col = vte_terminal_get_column_count(vte) - 1;
 
-        gtk_entry_completion_set_inline_selection(completion, TRUE);
-        gtk_entry_completion_set_text_column(completion, 0);
+    // The history ends at the screen, wherever the cursor is. In selection mode it is the vi
+    // cursor, which may be up in the history, and then the whole screen is read.
+    const long history_end = last_row(vte) + 1 - vte_terminal_get_row_count(vte);
+    if (cursor_row < history_end) {
+        cursor_row = last_row(vte);
+        cursor_col = end_col;
     }
 
-    gtk_entry_set_text(GTK_ENTRY(info->entry), "");
+    // rows were dropped from the scrollback, or the terminal was reset
+    if (index->indexed_row < first_row(vte)) {
+        index->indexed_row = first_row(vte);
+    }
 
-    info->mode = mode;
-    gtk_widget_show(info->entry);
-    gtk_widget_grab_focus(info->entry);
-}
+    index->generation++;
 
-void get_vte_padding(VteTerminal *vte, int *left, int *top, int *right, int *bottom) {
-    GtkBorder border;
-    gtk_style_context_get_padding(gtk_widget_get_style_context(GTK_WIDGET(vte)),
-                                  gtk_widget_get_state_flags(GTK_WIDGET(vte)),
-                                  &border);
-    *left = border.left;
-    *right = border.right;
-    *top = border.top;
-    *bottom = border.bottom;
-}
+    // rows of the history are only read once, in bounded chunks
+    while (index->indexed_row < history_end) {
+        const long end_row = std::min(index->indexed_row + chunk_rows, history_end) - 1;
+        auto content = get_text_range(vte, index->indexed_row, 0, end_row, end_col);
+        if (content) {
+            add_tokens(index, content.get());
+        }
+        index->indexed_row = end_row + 1;
+        evict_tokens(index);
+    }
 
-char *check_match(VteTerminal *vte, GdkEventButton *event) {
-    int tag;
+    evict_tokens(index);
+    sort_tokens(index);
 
-    return vte_terminal_match_check_event(vte, (GdkEvent*) event, &tag);
+    // the screen up to the cursor replaces what was read from it last time
+    index->screen.clear();
+    if (auto content = get_text_range(vte, index->indexed_row, 0, cursor_row, cursor_col)) {
+        for_each_token(content.get(), [index](const char *token) {
+            index->screen.emplace_back(token);
+        });
+    }
+    std::sort(index->screen.begin(), index->screen.end());
+    index->screen.erase(std::unique(index->screen.begin(), index->screen.end()),
+                        index->screen.end());
 }
 
-/* {{{ CONFIG LOADING */
+/* {{{ COMPLETION MODEL */
+// A flat GtkTreeModel exposing the window of indexed tokens that start with the text typed in
+// the entry. The prefix is located with a binary search over the sorted token array, so
+// GtkEntryCompletion only ever filters a bounded number of rows.
+struct _TermiteTokenModel {
+    GObject parent_instance;
+    token_index *index;
+    std::vector<std::string> *rows;
+};
+
+static const size_t token_model_rows = 1000;
+
+static void termite_token_model_tree_model_init(GtkTreeModelIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(TermiteTokenModel, termite_token_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL,
+                                              termite_token_model_tree_model_init))
+
+static void termite_token_model_init(TermiteTokenModel *model) {
+    model->index = nullptr;
+    model->rows = new std::vector<std::string>;
+}
+
+static void termite_token_model_finalize(GObject *object) {
+    TermiteTokenModel *model = TERMITE_TOKEN_MODEL(object);
+    delete model->rows;
+    G_OBJECT_CLASS(termite_token_model_parent_class)->finalize(object);
+}
+
+static void termite_token_model_class_init(TermiteTokenModelClass *klass) {
+    G_OBJECT_CLASS(klass)->finalize = termite_token_model_finalize;
+}
+
+static GtkTreeModelFlags token_model_get_flags(GtkTreeModel *) {
+    return GTK_TREE_MODEL_LIST_ONLY;
+}
+
+static gint token_model_get_n_columns(GtkTreeModel *) {
+    return 1;
+}
+
+static GType token_model_get_column_type(GtkTreeModel *, gint) {
+    return G_TYPE_STRING;
+}
+
+static gboolean token_model_iter_nth_child(GtkTreeModel *tree, GtkTreeIter *iter,
+                                           GtkTreeIter *parent, gint n) {
+    TermiteTokenModel *model = TERMITE_TOKEN_MODEL(tree);
+    if (parent || n < 0 || (size_t)n >= model->rows->size()) {
+        return FALSE;
+    }
+    iter->user_data = GINT_TO_POINTER(n);
+    return TRUE;
+}
+
+static gboolean token_model_get_iter(GtkTreeModel *tree, GtkTreeIter *iter, GtkTreePath *path) {
+    if (gtk_tree_path_get_depth(path) != 1) {
+        return FALSE;
+    }
+    return token_model_iter_nth_child(tree, iter, nullptr, gtk_tree_path_get_indices(path)[0]);
+}
+
+static GtkTreePath *token_model_get_path(GtkTreeModel *, GtkTreeIter *iter) {
+    return gtk_tree_path_new_from_indices(GPOINTER_TO_INT(iter->user_data), -1);
+}
+
+static void token_model_get_value(GtkTreeModel *tree, GtkTreeIter *iter, gint, GValue *value) {
+    TermiteTokenModel *model = TERMITE_TOKEN_MODEL(tree);
+    g_value_init(value, G_TYPE_STRING);
+    g_value_set_string(value, (*model->rows)[(size_t)GPOINTER_TO_INT(iter->user_data)].c_str());
+}
+
+static gboolean token_model_iter_next(GtkTreeModel *tree, GtkTreeIter *iter) {
+    return token_model_iter_nth_child(tree, iter, nullptr, GPOINTER_TO_INT(iter->user_data) + 1);
+}
+
+static gboolean token_model_iter_children(GtkTreeModel *tree, GtkTreeIter *iter,
+                                          GtkTreeIter *parent) {
+    return token_model_iter_nth_child(tree, iter, parent, 0);
+}
+
+static gboolean token_model_iter_has_child(GtkTreeModel *, GtkTreeIter *) {
+    return FALSE;
+}
+
+static gint token_model_iter_n_children(GtkTreeModel *tree, GtkTreeIter *iter) {
+    return iter ? 0 : (gint)TERMITE_TOKEN_MODEL(tree)->rows->size();
+}
+
+static gboolean token_model_iter_parent(GtkTreeModel *, GtkTreeIter *, GtkTreeIter *) {
+    return FALSE;
+}
+
+void termite_token_model_tree_model_init(GtkTreeModelIface *iface) {
+    iface->get_flags = token_model_get_flags;
+    iface->get_n_columns = token_model_get_n_columns;
+    iface->get_column_type = token_model_get_column_type;
+    iface->get_iter = token_model_get_iter;
+    iface->get_path = token_model_get_path;
+    iface->get_value = token_model_get_value;
+    iface->iter_next = token_model_iter_next;
+    iface->iter_children = token_model_iter_children;
+    iface->iter_has_child = token_model_iter_has_child;
+    iface->iter_n_children = token_model_iter_n_children;
+    iface->iter_nth_child = token_model_iter_nth_child;
+    iface->iter_parent = token_model_iter_parent;
+}
+
+static TermiteTokenModel *token_model_new(token_index *index) {
+    TermiteTokenModel *model =
+        TERMITE_TOKEN_MODEL(g_object_new(termite_token_model_get_type(), nullptr));
+    model->index = index;
+    return model;
+}
+
+static void token_model_delete_row(TermiteTokenModel *model, size_t n) {
+    model->rows->erase(model->rows->begin() + (long)n);
+    GtkTreePath *path = gtk_tree_path_new_from_indices((gint)n, -1);
+    gtk_tree_model_row_deleted(GTK_TREE_MODEL(model), path);
+    gtk_tree_path_free(path);
+}
+
+// Replace the exposed window, only emitting signals for rows entering or leaving it.
+static void token_model_set_prefix(TermiteTokenModel *model, const char *prefix) {
+    std::vector<std::string> rows;
+    if (model->index) {
+        const std::vector<const std::string *> &sorted = model->index->sorted;
+        const std::vector<std::string> &screen = model->index->screen;
+        const std::string key(prefix);
+        auto matches = [&key](const std::string &token) {
+            return token.compare(0, key.size(), key) == 0;
+        };
+        auto it = std::lower_bound(sorted.begin(), sorted.end(), key,
+                                   [](const std::string *token, const std::string &value) {
+                                       return *token < value;
+                                   });
+        auto screen_it = std::lower_bound(screen.begin(), screen.end(), key);
+
+        // merge the indexed and the screen tokens, both sorted
+        while (rows.size() < token_model_rows) {
+            const bool indexed = it != sorted.end() && matches(**it);
+            const bool on_screen = screen_it != screen.end() && matches(*screen_it);
+            if (!indexed && !on_screen) {
+                break;
+            }
+            const std::string &token = !on_screen || (indexed && **it <= *screen_it) ?
+                **it++ : *screen_it++;
+            if (rows.empty() || rows.back() != token) {
+                rows.push_back(token);
+            }
+        }
+    }
+
+    std::vector<std::string> &current = *model->rows;
+    size_t start = current.size(), overlap = 0;
+    if (!rows.empty()) {
+        start = (size_t)(std::lower_bound(current.begin(), current.end(), rows.front()) -
+                         current.begin());
+        while (start + overlap < current.size() && overlap < rows.size() &&
+               current[start + overlap] == rows[overlap]) {
+            overlap++;
+        }
+    }
+
+    while (current.size() > start + overlap) {
+        token_model_delete_row(model, current.size() - 1);
+    }
+    while (current.size() > overlap) {
+        token_model_delete_row(model, 0);
+    }
+
+    for (size_t i = overlap; i < rows.size(); i++) {
+        current.push_back(std::move(rows[i]));
+        GtkTreeIter iter;
+        iter.user_data = GINT_TO_POINTER((gint)i);
+        GtkTreePath *path = gtk_tree_path_new_from_indices((gint)i, -1);
+        gtk_tree_model_row_inserted(GTK_TREE_MODEL(model), path, &iter);
+        gtk_tree_path_free(path);
+    }
+}
+
+static void completion_changed_cb(GtkEntry *entry, search_panel_info *info) {
+    if (info->token_model && gtk_entry_get_completion(entry)) {
+        token_model_set_prefix(info->token_model, gtk_entry_get_text(entry));
+    }
+}
+
+static gboolean completion_match_func(GtkEntryCompletion *, const char *, GtkTreeIter *, void *) {
+    return TRUE; // the model only holds matching tokens
+}
+/* }}} */
+
+/* {{{ SEARCH INDEX */
+static const long search_block_rows = 64;
+static const long search_chunk_rows = 4096;
+
+static uint32_t trigram(const char *s) {
+    return (uint32_t)(unsigned char)s[0] << 16 | (uint32_t)(unsigned char)s[1] << 8 |
+           (uint32_t)(unsigned char)s[2];
+}
+
+static void add_posting(posting_list *list, uint32_t block) {
+    uint32_t delta = list->data.empty() ? block : block - list->last;
+    do {
+        uint8_t byte = delta & 0x7f;
+        delta >>= 7;
+        list->data.push_back(delta ? (uint8_t)(byte | 0x80) : byte);
+    } while (delta);
+    list->last = block;
+}
+
+static std::vector<uint32_t> decode_postings(const posting_list &list) {
+    std::vector<uint32_t> blocks;
+    uint32_t block = 0, delta = 0;
+    unsigned shift = 0;
+    for (uint8_t byte : list.data) {
+        delta |= (uint32_t)(byte & 0x7f) << shift;
+        if (byte & 0x80) {
+            shift += 7;
+            continue;
+        }
+        block += delta;
+        blocks.push_back(block);
+        delta = 0;
+        shift = 0;
+    }
+    return blocks;
+}
+
+// Blocks that may hold a match starting in them: those with the trigram or followed by one
+// that has it, as a match may run into the next block before reaching its literals.
+static std::vector<uint32_t> candidate_blocks(const posting_list &list) {
+    std::vector<uint32_t> blocks;
+    for (uint32_t block : decode_postings(list)) {
+        if (block && (blocks.empty() || blocks.back() < block - 1)) {
+            blocks.push_back(block - 1);
+        }
+        if (blocks.empty() || blocks.back() < block) {
+            blocks.push_back(block);
+        }
+    }
+    return blocks;
+}
+
+static void cancel_search(search_index *index) {
+    if (search_task *task = index->task.get()) {
+        task->cancelled = true;
+        task->info = nullptr;
+        if (task->feed_source) {
+            g_source_remove(task->feed_source);
+        }
+        index->task.reset();
+    }
+}
+
+static void reset_search_index(search_index *index, long base_row, long columns) {
+    cancel_search(index); // the rows it is searching have moved
+    index->postings.clear();
+    index->base_row = base_row;
+    index->columns = columns;
+    index->n_blocks = 0;
+    index->matches.clear();
+    index->matches_end = 0;
+}
+
+// Forget the first dead blocks, renumbering the rest so they start from zero.
+static void drop_search_blocks(search_index *index, uint32_t dead) {
+    for (auto it = index->postings.begin(); it != index->postings.end();) {
+        posting_list list{};
+        for (uint32_t block : decode_postings(it->second)) {
+            if (block >= dead) {
+                add_posting(&list, block - dead);
+            }
+        }
+        if (list.data.empty()) {
+            it = index->postings.erase(it);
+        } else {
+            list.data.shrink_to_fit();
+            it->second = std::move(list);
+            ++it;
+        }
+    }
+    index->base_row += (long)dead * search_block_rows;
+    index->n_blocks -= dead;
+}
+
+// Index up to max_blocks blocks of rows that have scrolled into the history, returning whether
+// there is more left to do.
+static bool index_search_blocks(VteTerminal *vte, search_index *index, uint32_t max_blocks) {
+    const long columns = vte_terminal_get_column_count(vte);
+    const long history_end = last_row(vte) + 1 - vte_terminal_get_row_count(vte);
+    long indexed_end = index->base_row + (long)index->n_blocks * search_block_rows;
+
+    // rewrapped, reset or the indexed rows were dropped from the scrollback
+    if (columns != index->columns || history_end < indexed_end || first_row(vte) > indexed_end) {
+        reset_search_index(index, first_row(vte), columns);
+        indexed_end = index->base_row;
+    }
+
+    // blocks scrolled off the top are only forgotten once they are the majority, as every
+    // posting list has to be rewritten
+    const long dead = (first_row(vte) - index->base_row) / search_block_rows;
+    if (dead > (long)index->n_blocks / 2) {
+        drop_search_blocks(index, (uint32_t)dead);
+    }
+
+    for (uint32_t i = 0; i < max_blocks; i++) {
+        // the row after the block is included to catch matches wrapping over the boundary
+        const long end_row = indexed_end + search_block_rows;
+        if (end_row >= history_end) {
+            return false;
+        }
+        auto content = get_text_range(vte, indexed_end, 0, end_row, columns - 1);
+        std::string text(content ? content.get() : "");
+        for (char &c : text) {
+            c = g_ascii_tolower(c);
+        }
+
+        std::vector<uint32_t> trigrams;
+        for (size_t j = 0; j + 2 < text.size(); j++) {
+            if (text[j] != '\n' && text[j + 1] != '\n' && text[j + 2] != '\n') {
+                trigrams.push_back(trigram(&text[j]));
+            }
+        }
+        std::sort(trigrams.begin(), trigrams.end());
+        trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+        for (uint32_t t : trigrams) {
+            add_posting(&index->postings[t], index->n_blocks);
+        }
+        index->n_blocks++;
+        indexed_end += search_block_rows;
+    }
+    return true;
+}
+
+static gboolean search_index_idle_cb(keybind_info *info) {
+    search_index *index = &info->panel.search;
+    if (index_search_blocks(info->vte, index, 16)) {
+        return G_SOURCE_CONTINUE;
+    }
+    index->idle_source = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_search_index(keybind_info *info) {
+    search_index *index = &info->panel.search;
+    if (index->enabled && !index->idle_source && !info->idle.reclaimed) {
+        index->idle_source = g_idle_add_full(G_PRIORITY_LOW, (GSourceFunc)search_index_idle_cb,
+                                             info, nullptr);
+    }
+}
+
+// Row ranges that may contain the start of a match: the indexed blocks where each required
+// trigram is in the block or the one after it, followed by the rows that are not indexed yet.
+static std::vector<std::pair<long, long>> search_ranges(VteTerminal *vte, const search_index *index,
+                                                        const char *pattern) {
+    std::vector<std::pair<long, long>> ranges;
+    const long first = first_row(vte);
+    const long indexed_end = index->base_row + (long)index->n_blocks * search_block_rows;
+    auto add = [&](long start, long end) {
+        start = std::max(start, first);
+        if (start > end) {
+            return;
+        }
+        if (!ranges.empty() && ranges.back().second + 1 >= start) {
+            ranges.back().second = std::max(ranges.back().second, end);
+        } else {
+            ranges.emplace_back(start, end);
+        }
+    };
+
+    std::vector<std::string> literals;
+    std::vector<uint32_t> trigrams;
+    // a match may have a row break at every character, so literals further in than a block of
+    // rows can be past the block after the one it starts in
+    if (required_literals(pattern, (size_t)search_block_rows, &literals)) {
+        for (const std::string &literal : literals) {
+            for (size_t i = 0; i + 2 < literal.size(); i++) {
+                trigrams.push_back(trigram(&literal[i]));
+            }
+        }
+    }
+
+    if (trigrams.empty()) {
+        add(first, last_row(vte));
+        return ranges;
+    }
+
+    std::vector<const posting_list *> lists;
+    for (uint32_t t : trigrams) {
+        auto it = index->postings.find(t);
+        if (it == index->postings.end()) {
+            lists.clear();
+            break;
+        }
+        lists.push_back(&it->second);
+    }
+    if (!lists.empty()) {
+        std::sort(lists.begin(), lists.end(), [](const posting_list *a, const posting_list *b) {
+            return a->data.size() < b->data.size();
+        });
+        std::vector<uint32_t> blocks = candidate_blocks(*lists[0]);
+        for (size_t i = 1; i < lists.size() && !blocks.empty(); i++) {
+            const std::vector<uint32_t> other = candidate_blocks(*lists[i]);
+            std::vector<uint32_t> common;
+            std::set_intersection(blocks.begin(), blocks.end(), other.begin(), other.end(),
+                                  std::back_inserter(common));
+            blocks.swap(common);
+        }
+        for (uint32_t block : blocks) {
+            const long start = index->base_row + (long)block * search_block_rows;
+            add(start, start + search_block_rows - 1);
+        }
+    }
+    // matches in the last indexed block may reach their literals in the rows after it
+    add(std::max(index->base_row, indexed_end - search_block_rows), last_row(vte));
+    return ranges;
+}
+
+// Append the matches in text that start at or before end_row.
+static void match_text(const pcre2_code *code, pcre2_match_data *match_data, const char *text,
+                       GArray *attributes, uint32_t options, long end_row,
+                       std::vector<search_match> *matches, const std::atomic<bool> *cancelled) {
+    const PCRE2_SIZE length = strlen(text);
+    PCRE2_SIZE offset = 0;
+    while (offset < length && !(cancelled && *cancelled) &&
+           pcre2_match(code, (PCRE2_SPTR)text, length, offset, PCRE2_NOTEMPTY | options,
+                       match_data, nullptr) > 0) {
+        const PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
+        offset = ovector[1];
+        const auto begin = g_array_index(attributes, VteCharAttributes, ovector[0]);
+        const auto end = g_array_index(attributes, VteCharAttributes, ovector[1] - 1);
+        if (begin.row > end_row) {
+            break;
+        }
+        matches->push_back({begin.row, begin.column, end.row, end.column});
+    }
+}
+
+// Text of the rows plus a block after them, to catch matches running over the end, extended to
+// the end of the line so a match starting in a long soft wrapped line isn't cut off. Text
+// starting in the middle of a line gets PCRE2_NOTBOL in options, so ^ doesn't match there.
+static char *get_search_text(VteTerminal *vte, long start_row, long end_row, GArray *attributes,
+                             uint32_t *options) {
+    const long last = last_row(vte);
+    long end = std::min(end_row + search_block_rows, last);
+    while (end < last && row_soft_wrapped(vte, end)) {
+        end++;
+    }
+    const bool mid_line = start_row > first_row(vte) && row_soft_wrapped(vte, start_row - 1);
+    *options = mid_line ? PCRE2_NOTBOL : 0;
+    return vte_terminal_get_text_range(vte, start_row, 0, end,
+                                       vte_terminal_get_column_count(vte) - 1,
+                                       nullptr, nullptr, attributes);
+}
+
+// Drop the matches in rows removed from the scrollback or that were still changeable last time,
+// returning the ranges to search again.
+static std::vector<std::pair<long, long>> stale_search_ranges(VteTerminal *vte,
+                                                              search_index *index) {
+    std::vector<search_match> &matches = index->matches;
+    const long first = first_row(vte);
+    matches.erase(std::lower_bound(matches.begin(), matches.end(), index->matches_end,
+                                   [](const search_match &m, long row) { return m.row < row; }),
+                  matches.end());
+    matches.erase(matches.begin(),
+                  std::lower_bound(matches.begin(), matches.end(), first,
+                                   [](const search_match &m, long row) { return m.row < row; }));
+
+    std::vector<std::pair<long, long>> ranges;
+    for (const auto &range : search_ranges(vte, index, index->pattern.c_str())) {
+        if (range.second >= index->matches_end) {
+            ranges.emplace_back(std::max(range.first, index->matches_end), range.second);
+        }
+    }
+    return ranges;
+}
+
+// Search the ranges on the main thread, for the few rows written since the last search.
+static void update_matches(VteTerminal *vte, search_index *index, cached_regex *regex,
+                           const std::vector<std::pair<long, long>> &ranges) {
+    for (const auto &range : ranges) {
+        for (long row = range.first; row <= range.second; row += search_chunk_rows) {
+            const long end_row = std::min(row + search_chunk_rows - 1, range.second);
+            GArray *attributes = g_array_new(FALSE, FALSE, sizeof(VteCharAttributes));
+            uint32_t options;
+            if (auto text = make_unique(get_search_text(vte, row, end_row, attributes, &options),
+                                        g_free)) {
+                match_text(regex->code, regex->match_data, text.get(), attributes, options,
+                           end_row, &index->matches, nullptr);
+            }
+            g_array_free(attributes, TRUE);
+        }
+    }
+    index->matches_end = std::max(last_row(vte) + 1 - vte_terminal_get_row_count(vte),
+                                  first_row(vte));
+}
+
+static void show_status(search_panel_info *panel, const char *status) {
+    GtkEntry *entry = GTK_ENTRY(panel_entry(panel));
+    gtk_entry_set_completion(entry, nullptr);
+    gtk_entry_set_text(entry, status);
+    gtk_editable_set_editable(GTK_EDITABLE(entry), FALSE);
+    gtk_widget_show(panel->entry);
+}
+
+static void select_match(VteTerminal *vte, const search_match &match) {
+    long end_col = match.end_col;
+#if VTE_CHECK_VERSION(0, 55, 0)
+    end_col++;
+#endif
+    vte_terminal_select_text(vte, match.col, match.row, end_col, match.end_row);
+
+    GtkAdjustment *adjust = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(vte));
+    const long rows = vte_terminal_get_row_count(vte);
+    if (match.row < top_row(vte) || match.row >= top_row(vte) + rows) {
+        gtk_adjustment_set_value(adjust, (double)clamp(match.row - rows / 2, first_row(vte),
+                                                       last_row(vte) + 1 - rows));
+    }
+}
+/* }}} */
+
+/* {{{ BACKGROUND SEARCH */
+static const long search_task_rows = 1024;
+
+static void jump_to_match(keybind_info *info, bool reverse) {
+    search_index *index = &info->panel.search;
+    std::pair<long, long> from;
+    if (index->has_match) {
+        from = {index->match_row, index->match_col};
+    } else {
+        long cursor_col, cursor_row;
+        vte_terminal_get_cursor_position(info->vte, &cursor_col, &cursor_row);
+        from = {cursor_row, reverse ? cursor_col : cursor_col - 1};
+    }
+
+    const std::vector<search_match> &matches = index->matches;
+    auto position = [](const search_match &m) { return std::make_pair(m.row, m.col); };
+    auto it = matches.end();
+    if (!reverse) {
+        it = std::upper_bound(matches.begin(), matches.end(), from,
+                              [&](const std::pair<long, long> &p, const search_match &m) {
+                                  return p < position(m);
+                              });
+        if (it == matches.end() && index->wrap) {
+            it = matches.begin();
+        }
+    } else {
+        auto next = std::lower_bound(matches.begin(), matches.end(), from,
+                                     [&](const search_match &m, const std::pair<long, long> &p) {
+                                         return position(m) < p;
+                                     });
+        if (next != matches.begin()) {
+            it = next - 1;
+        } else if (index->wrap && !matches.empty()) {
+            it = matches.end() - 1;
+        }
+    }
+    if (it == matches.end()) {
+        show_status(&info->panel, "no matches");
+        return;
+    }
+
+    index->has_match = true;
+    index->match_row = it->row;
+    index->match_col = it->col;
+    select_match(info->vte, *it);
+    vte_terminal_copy_primary(info->vte);
+
+    char *status = g_strdup_printf("match %zu of %zu", (size_t)(it - matches.begin()) + 1,
+                                   matches.size());
+    show_status(&info->panel, status);
+    g_free(status);
+}
+
+static gboolean search_chunk_done_cb(search_chunk *chunk);
+
+static void search_chunk_worker(gpointer data, gpointer) {
+    search_chunk *chunk = static_cast<search_chunk *>(data);
+    search_task *task = chunk->task.get();
+    if (!task->cancelled && chunk->text) {
+        // match data can't be shared between threads
+        pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(task->code, nullptr);
+        match_text(task->code, match_data, chunk->text, chunk->attributes, chunk->options,
+                   chunk->end_row, &chunk->matches, &task->cancelled);
+        pcre2_match_data_free(match_data);
+    }
+    g_free(chunk->text);
+    g_array_free(chunk->attributes, TRUE);
+    chunk->text = nullptr;
+    chunk->attributes = nullptr;
+    g_idle_add((GSourceFunc)search_chunk_done_cb, chunk);
+}
+
+static GThreadPool *search_pool() {
+    static GThreadPool *pool = nullptr;
+    if (!pool) {
+        pool = g_thread_pool_new(search_chunk_worker, nullptr, (gint)g_get_num_processors(),
+                                 FALSE, nullptr);
+    }
+    return pool;
+}
+
+// Hand out one chunk of rows per main loop iteration, so output and keys are still handled.
+// The text has to be read here as VTE may only be used from the main thread.
+static gboolean search_feed_cb(search_task *task) {
+    keybind_info *info = task->info;
+    if (task->range == task->ranges.size() || task->in_flight >= 2 * g_get_num_processors()) {
+        task->feed_source = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    const std::pair<long, long> &range = task->ranges[task->range];
+    const long end_row = std::min(task->next_row + search_task_rows - 1, range.second);
+    GArray *attributes = g_array_new(FALSE, FALSE, sizeof(VteCharAttributes));
+    uint32_t options;
+    char *text = get_search_text(info->vte, task->next_row, end_row, attributes, &options);
+    task->in_flight++;
+    g_thread_pool_push(search_pool(),
+                       new search_chunk{info->panel.search.task, end_row, text, attributes,
+                                        options, {}},
+                       nullptr);
+
+    task->next_row = end_row + 1;
+    if (task->next_row > range.second && ++task->range < task->ranges.size()) {
+        task->next_row = task->ranges[task->range].first;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+gboolean search_chunk_done_cb(search_chunk *chunk) {
+    const std::shared_ptr<search_task> task = chunk->task;
+    task->in_flight--;
+    if (keybind_info *info = task->info) {
+        std::vector<search_match> &matches = info->panel.search.matches;
+        if (!chunk->matches.empty()) {
+            // chunks cover disjoint rows, so their matches are inserted as a block
+            auto at = std::lower_bound(matches.begin(), matches.end(), chunk->matches.front(),
+                                       [](const search_match &a, const search_match &b) {
+                                           return std::make_pair(a.row, a.col) <
+                                                  std::make_pair(b.row, b.col);
+                                       });
+            matches.insert(at, chunk->matches.begin(), chunk->matches.end());
+        }
+
+        if (task->range < task->ranges.size()) {
+            if (!task->feed_source) {
+                task->feed_source = g_idle_add((GSourceFunc)search_feed_cb, task.get());
+            }
+        } else if (!task->in_flight) {
+            info->panel.search.matches_end = task->matches_end;
+            info->panel.search.task.reset();
+            task->info = nullptr;
+            jump_to_match(info, task->reverse);
+        }
+        if (task->info) {
+            char *status = g_strdup_printf("searching: %zu matches", matches.size());
+            show_status(&info->panel, status);
+            g_free(status);
+        }
+    }
+    delete chunk;
+    return G_SOURCE_REMOVE;
+}
+
+// Search the ranges with the thread pool, adding to the matches already found and jumping once
+// it is done. Rows that aren't indexed yet are searched like any other range.
+static void start_search_task(keybind_info *info, const cached_regex *regex,
+                              std::vector<std::pair<long, long>> ranges, bool reverse) {
+    VteTerminal *vte = info->vte;
+    search_index *index = &info->panel.search;
+    const long matches_end = std::max(last_row(vte) + 1 - vte_terminal_get_row_count(vte),
+                                      first_row(vte));
+    if (ranges.empty()) {
+        index->matches_end = matches_end;
+        jump_to_match(info, reverse);
+        return;
+    }
+    index->task = std::make_shared<search_task>();
+    search_task *task = index->task.get();
+    task->cancelled = false;
+    // workers get their own copy, the cached one may be evicted while they run
+    task->code = pcre2_code_copy(regex->code);
+    pcre2_jit_compile(task->code, PCRE2_JIT_COMPLETE);
+    task->info = info;
+    task->range = 0;
+    task->next_row = ranges.front().first;
+    task->ranges = std::move(ranges);
+    task->in_flight = 0;
+    task->reverse = reverse;
+    task->matches_end = matches_end;
+    task->feed_source = g_idle_add((GSourceFunc)search_feed_cb, task);
+    show_status(&info->panel, "searching");
+}
+/* }}} */
+
+/* {{{ PASTE */
+static const size_t paste_chunk_size = 4096;
+
+static const char paste_start[] = "\033[200~";
+static const char paste_end[] = "\033[201~";
+
+static void write_chunk(VteTerminal *vte, const std::string &text, size_t offset, size_t length) {
+    vte_terminal_feed_child(vte, text.data() + offset, (glong)length);
+}
+
+#if VTE_CHECK_VERSION(0, 68, 0)
+// The filtering VTE applies to a paste: newlines become carriage returns, and C0 controls other
+// than tabs, DEL and C1 controls are dropped, so the text can't end a bracketed paste early
+// in either the 7 or 8 bit form. This is done on the whole text, as a CRLF may be split between
+// chunks.
+static std::string paste_payload(const char *text) {
+    std::string payload;
+    for (const char *p = text; *p; p++) {
+        const unsigned char c = (unsigned char)*p;
+        if (c == '\r' || c == '\n') {
+            if (c == '\r' && p[1] == '\n') {
+                p++;
+            }
+            payload += '\r';
+        } else if (c == 0xc2 && (unsigned char)p[1] >= 0x80 && (unsigned char)p[1] <= 0x9f) {
+            p++; // U+0080 to U+009F
+        } else if ((c >= 0x20 && c != 0x7f) || c == '\t') {
+            payload += *p;
+        }
+    }
+    return payload;
+}
+#endif
+
+static void hide_paste_progress(keybind_info *info) {
+    if (info->paste.progress) {
+        info->paste.progress = false;
+        if (info->panel.mode == overlay_mode::hidden && info->select.mode == vi_mode::insert) {
+            hide_overlay_widget(info->panel.entry);
+        }
+    }
+}
+
+static void cancel_paste(keybind_info *info) {
+    paste_info &paste = info->paste;
+    if (paste.watch) {
+        g_source_remove(paste.watch);
+        paste.watch = 0;
+    }
+    // a paste cut short still has to be ended
+    if (paste.bracketed) {
+        vte_terminal_feed_child(info->vte, paste_end, (glong)(sizeof paste_end - 1));
+        paste.bracketed = false;
+    }
+    paste.pending.clear();
+    paste.offset = paste.total = paste.written = 0;
+    hide_paste_progress(info);
+}
+
+// VTE writes its own output buffer to the pty at a higher priority, so it has drained by the
+// time the pty is still writable here and the queued text never piles up in it.
+static gboolean paste_writable_cb(gint, GIOCondition condition, keybind_info *info) {
+    paste_info &paste = info->paste;
+    if (condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+        paste.watch = 0;
+        paste.bracketed = false;
+        cancel_paste(info);
+        return G_SOURCE_REMOVE;
+    }
+
+    const std::string &text = paste.pending.front().first;
+#if VTE_CHECK_VERSION(0, 68, 0)
+    if (paste.pending.front().second && !paste.offset) {
+        bool bracketed;
+        if (!recorded_paste_mode(info->vte, &bracketed)) {
+            // VTE frames it when the mode can't be followed, at the cost of buffering it all
+            vte_terminal_paste_text(info->vte, text.c_str());
+            paste.written += text.size();
+            paste.pending.pop_front();
+            if (paste.pending.empty()) {
+                paste.watch = 0;
+                cancel_paste(info);
+                return G_SOURCE_REMOVE;
+            }
+            return G_SOURCE_CONTINUE;
+        }
+        if (bracketed) {
+            vte_terminal_feed_child(info->vte, paste_start, (glong)(sizeof paste_start - 1));
+            paste.bracketed = true;
+        }
+    }
+#endif
+    size_t length = std::min(paste_chunk_size, text.size() - paste.offset);
+    // don't split a UTF-8 sequence
+    while (paste.offset + length < text.size() && length > 1 &&
+           (text[paste.offset + length] & 0xc0) == 0x80) {
+        length--;
+    }
+    write_chunk(info->vte, text, paste.offset, length);
+    paste.offset += length;
+    paste.written += length;
+    if (paste.offset == text.size()) {
+        if (paste.bracketed) {
+            vte_terminal_feed_child(info->vte, paste_end, (glong)(sizeof paste_end - 1));
+            paste.bracketed = false;
+        }
+        paste.pending.pop_front();
+        paste.offset = 0;
+    }
+
+    if (paste.pending.empty()) {
+        paste.watch = 0;
+        cancel_paste(info);
+        return G_SOURCE_REMOVE;
+    }
+    if (info->panel.mode == overlay_mode::hidden && info->select.mode == vi_mode::insert &&
+        paste.total > 16 * paste_chunk_size) {
+        char status[64];
+        snprintf(status, sizeof status, "pasting: %zu%% (escape to cancel)",
+                 paste.written * 100 / paste.total);
+        show_status(&info->panel, status);
+        paste.progress = true;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Queue text for the child, so large pastes neither block the UI nor overrun a slow reader.
+static void feed_child_async(keybind_info *info, std::string text, bool paste) {
+    VtePty *pty = vte_terminal_get_pty(info->vte);
+    if (text.empty() || !pty) {
+        return;
+    }
+    paste_info &state = info->paste;
+    if (!state.watch && !paste && text.size() <= paste_chunk_size) {
+        write_chunk(info->vte, text, 0, text.size());
+        return;
+    }
+    state.total += text.size();
+    state.pending.emplace_back(std::move(text), paste);
+    if (!state.watch) {
+        state.watch = g_unix_fd_add_full(G_PRIORITY_LOW, vte_pty_get_fd(pty), G_IO_OUT,
+                                         (GUnixFDSourceFunc)paste_writable_cb, info, nullptr);
+    }
+}
+
+#if VTE_CHECK_VERSION(0, 68, 0)
+// The window may be gone by the time the text arrives, so look it up again. Pastes that fit in
+// a chunk are left to VTE, unless they would overtake one still being written. Larger ones are
+// only written a chunk at a time while the bracketed paste mode is known, which is when the
+// output passes through termite to be recorded.
+static void paste_text_cb(GtkClipboard *, const char *text, gpointer data) {
+    VteTerminal *vte = VTE_TERMINAL(data);
+    for (window_info *win : windows) {
+        if (win->keybind.vte == vte && text) {
+            if (!win->keybind.paste.watch && strlen(text) <= paste_chunk_size) {
+                vte_terminal_paste_text(vte, text);
+            } else {
+                feed_child_async(&win->keybind, paste_payload(text), true);
+            }
+        }
+    }
+    g_object_unref(vte);
+}
+#endif
+
+// VTE before 0.68 can only paste the clipboard on its own, so there is no way to learn whether
+// a paste has to be framed and the whole paste is left to it.
+static void paste_clipboard(VteTerminal *vte) {
+#if VTE_CHECK_VERSION(0, 68, 0)
+    gtk_clipboard_request_text(gtk_widget_get_clipboard(GTK_WIDGET(vte), GDK_SELECTION_CLIPBOARD),
+                               paste_text_cb, g_object_ref(vte));
+#else
+    vte_terminal_paste_clipboard(vte);
+#endif
+}
+/* }}} */
+
+void search(keybind_info *info, const char *pattern, bool reverse) {
+    VteTerminal *vte = info->vte;
+    search_index *index = &info->panel.search;
+    if (index->enabled) {
+        cancel_search(index);
+        index->pattern = pattern;
+        index->matches.clear();
+        index->matches_end = 0;
+        index->has_match = false;
+
+        cached_regex *regex = get_pcre_regex(pattern, PCRE2_MULTILINE | PCRE2_CASELESS);
+        if (!regex) {
+            index->pattern.clear();
+            return;
+        }
+        start_search_task(info, regex, search_ranges(vte, index, pattern), reverse);
+        return;
+    }
+
+    VteRegex *regex = get_vte_regex(pattern, PCRE2_MULTILINE | PCRE2_CASELESS, true);
+    if (!regex) {
+        return;
+    }
+    vte_terminal_search_set_regex(vte, regex, 0);
+
+    auto terminal_search = reverse ? vte_terminal_search_find_previous : vte_terminal_search_find_next;
+    if (!terminal_search(vte)) {
+        vte_terminal_unselect_all(vte);
+        terminal_search(vte);
+    }
+
+    vte_terminal_copy_primary(vte);
+}
+
+void search_next(keybind_info *info, bool reverse) {
+    VteTerminal *vte = info->vte;
+    search_index *index = &info->panel.search;
+    if (!index->enabled) {
+        if (reverse) {
+            vte_terminal_search_find_previous(vte);
+        } else {
+            vte_terminal_search_find_next(vte);
+        }
+        vte_terminal_copy_primary(vte);
+        return;
+    }
+
+    if (index->pattern.empty()) {
+        return;
+    }
+    if (index->task) {
+        index->task->reverse = reverse; // jumps once the search is done
+        return;
+    }
+    cached_regex *regex = get_pcre_regex(index->pattern.c_str(), PCRE2_MULTILINE | PCRE2_CASELESS);
+    if (!regex) {
+        return;
+    }
+    auto ranges = stale_search_ranges(vte, index);
+    long rows = 0;
+    for (const auto &range : ranges) {
+        rows += range.second - range.first + 1;
+    }
+    if (rows > search_task_rows) {
+        // too much output since the last search to go through here
+        start_search_task(info, regex, std::move(ranges), reverse);
+        return;
+    }
+    update_matches(vte, index, regex, ranges);
+    jump_to_match(info, reverse);
+}
+
+static GtkWidget *panel_entry(search_panel_info *panel) {
+    if (!panel->entry) {
+        GtkWidget *entry = gtk_entry_new();
+        gtk_widget_set_margin_start(entry, 5);
+        gtk_widget_set_margin_end(entry, 5);
+        gtk_widget_set_margin_top(entry, 5);
+        gtk_widget_set_margin_bottom(entry, 5);
+        gtk_widget_set_halign(entry, GTK_ALIGN_START);
+        gtk_widget_set_valign(entry, GTK_ALIGN_END);
+        gtk_overlay_add_overlay(GTK_OVERLAY(panel->entry_overlay), entry);
+
+        g_signal_connect(entry, "key-press-event", G_CALLBACK(entry_key_press_cb), panel->keybind);
+        g_signal_connect(entry, "changed", G_CALLBACK(completion_changed_cb), panel);
+        panel->entry = entry;
+    }
+    return panel->entry;
+}
+
+GtkWidget *hint_area(search_panel_info *panel) {
+    if (!panel->da) {
+        GtkWidget *da = gtk_drawing_area_new();
+        GdkRGBA transparent {0, 0, 0, 0};
+        override_background_color(da, &transparent);
+        gtk_widget_set_halign(da, GTK_ALIGN_FILL);
+        gtk_widget_set_valign(da, GTK_ALIGN_FILL);
+        gtk_overlay_add_overlay(GTK_OVERLAY(panel->hint_overlay), da);
+
+        g_signal_connect_swapped(da, "draw", G_CALLBACK(draw_cb), panel->draw);
+        panel->da = da;
+    }
+    return panel->da;
+}
+
+void overlay_show(search_panel_info *info, overlay_mode mode, VteTerminal *vte) {
+    GtkWidget *entry = panel_entry(info);
+    if (vte) {
+        GtkEntryCompletion *completion = gtk_entry_completion_new();
+        gtk_entry_set_completion(GTK_ENTRY(entry), completion);
+        g_object_unref(completion);
+
+        update_token_index(vte, &info->tokens);
+        if (!info->token_model) {
+            info->token_model = token_model_new(&info->tokens);
+        }
+        token_model_set_prefix(info->token_model, "");
+        gtk_entry_completion_set_model(completion, GTK_TREE_MODEL(info->token_model));
+        gtk_entry_completion_set_match_func(completion, completion_match_func, nullptr, nullptr);
+
+        gtk_entry_completion_set_inline_selection(completion, TRUE);
+        gtk_entry_completion_set_text_column(completion, 0);
+    }
+
+    gtk_entry_set_text(GTK_ENTRY(entry), "");
+    gtk_editable_set_editable(GTK_EDITABLE(entry), TRUE);
+
+    info->mode = mode;
+    gtk_widget_show(entry);
+    gtk_widget_grab_focus(entry);
+}
+
+void get_vte_padding(VteTerminal *vte, int *left, int *top, int *right, int *bottom) {
+    GtkBorder border;
+    gtk_style_context_get_padding(gtk_widget_get_style_context(GTK_WIDGET(vte)),
+                                  gtk_widget_get_state_flags(GTK_WIDGET(vte)),
+                                  &border);
+    *left = border.left;
+    *right = border.right;
+    *top = border.top;
+    *bottom = border.bottom;
+}
+
+char *check_match(VteTerminal *vte, GdkEventButton *event) {
+    int tag;
+
+    return vte_terminal_match_check_event(vte, (GdkEvent*) event, &tag);
+}
+
+/* {{{ CONFIG LOADING */
 template<typename T>
 maybe<T> get_config(T (*get)(GKeyFile *, const char *, const char *, GError **),
                     GKeyFile *config, const char *group, const char *key) {
     GError *error = nullptr;
-    maybe<T> value = get(config, group, key, &error);
-    if (error) {
+    maybe<T> value = get(config, group, key, &error);
+    if (error) {
+        g_error_free(error);
+        return {};
+    }
+    return value;
+}
+
+auto get_config_integer(std::bind(get_config<int>, g_key_file_get_integer,
+                                  _1, _2, _3));
+auto get_config_string(std::bind(get_config<char *>, g_key_file_get_string,
+                                 _1, _2, _3));
+auto get_config_double(std::bind(get_config<double>, g_key_file_get_double,
+                                 _1, _2, _3));
+
+static maybe<GdkRGBA> get_config_color(GKeyFile *config, const char *section, const char *key) {
+    if (auto s = get_config_string(config, section, key)) {
+        GdkRGBA color;
+        if (gdk_rgba_parse(&color, *s)) {
+            g_free(*s);
+            return color;
+        }
+        g_printerr("invalid color string: %s\n", *s);
+        g_free(*s);
+    }
+    return {};
+}
+
+static std::array<GdkRGBA, 256> parse_palette(GKeyFile *config) {
+    std::array<GdkRGBA, 256> palette;
+    char color_key[] = "color000";
+
+    for (unsigned i = 0; i < palette.size(); i++) {
+        snprintf(color_key, sizeof(color_key), "color%u", i);
+        if (auto color = get_config_color(config, "colors", color_key)) {
+            palette[i] = *color;
+        } else if (i < 16) {
+            palette[i].blue = (((i & 4) ? 0xc000 : 0) + (i > 7 ? 0x3fff: 0)) / 65535.0;
+            palette[i].green = (((i & 2) ? 0xc000 : 0) + (i > 7 ? 0x3fff : 0)) / 65535.0;
+            palette[i].red = (((i & 1) ? 0xc000 : 0) + (i > 7 ? 0x3fff : 0)) / 65535.0;
+            palette[i].alpha = 0;
+        } else if (i < 232) {
+            const unsigned j = i - 16;
+            const unsigned r = j / 36, g = (j / 6) % 6, b = j % 6;
+            const unsigned red =   (r == 0) ? 0 : r * 40 + 55;
+            const unsigned green = (g == 0) ? 0 : g * 40 + 55;
+            const unsigned blue =  (b == 0) ? 0 : b * 40 + 55;
+            palette[i].red   = (red | red << 8) / 65535.0;
+            palette[i].green = (green | green << 8) / 65535.0;
+            palette[i].blue  = (blue | blue << 8) / 65535.0;
+            palette[i].alpha = 0;
+        } else if (i < 256) {
+            const unsigned shade = 8 + (i - 232) * 10;
+            palette[i].red = palette[i].green = palette[i].blue = (shade | shade << 8) / 65535.0;
+            palette[i].alpha = 0;
+        }
+    }
+    return palette;
+}
+
+static maybe<std::string> get_config_std_string(GKeyFile *config, const char *group, const char *key) {
+    if (auto s = get_config_string(config, group, key)) {
+        std::string value(*s);
+        g_free(*s);
+        return value;
+    }
+    return {};
+}
+
+// a byte count with an optional K, M or G suffix
+static gint64 parse_size(const char *value) {
+    char *end;
+    const gint64 size = g_ascii_strtoll(value, &end, 10);
+    switch (g_ascii_toupper(*end)) {
+        case 'G':
+            return size << 30;
+        case 'M':
+            return size << 20;
+        case 'K':
+            return size << 10;
+        case '\0':
+            return size;
+    }
+    g_printerr("invalid size: %s\n", value);
+    return 0;
+}
+
+static config_snapshot parse_config(GKeyFile *config) {
+    auto cfg_bool = [config](const char *key, gboolean value) {
+        return get_config<gboolean>(g_key_file_get_boolean,
+                                    config, "options", key).get_value_or(value);
+    };
+
+    config_snapshot cfg;
+    cfg.scroll_on_output = cfg_bool("scroll_on_output", FALSE);
+    cfg.scroll_on_keystroke = cfg_bool("scroll_on_keystroke", TRUE);
+    cfg.audible_bell = cfg_bool("audible_bell", FALSE);
+    cfg.mouse_autohide = cfg_bool("mouse_autohide", FALSE);
+    cfg.allow_bold = cfg_bool("allow_bold", TRUE);
+    cfg.search_wrap = cfg_bool("search_wrap", TRUE);
+    cfg.hyperlinks = cfg_bool("hyperlinks", FALSE);
+    cfg.bold_is_bright = cfg_bool("bold_is_bright", TRUE);
+    cfg.cell_height_scale = get_config_double(config, "options", "cell_height_scale").get_value_or(1.0);
+    cfg.cell_width_scale = get_config_double(config, "options", "cell_width_scale").get_value_or(1.0);
+    cfg.dynamic_title = cfg_bool("dynamic_title", TRUE);
+    cfg.urgent_on_bell = cfg_bool("urgent_on_bell", TRUE);
+    cfg.clickable_url = cfg_bool("clickable_url", TRUE);
+    cfg.size_hints = cfg_bool("size_hints", FALSE);
+    cfg.filter_unmatched_urls = cfg_bool("filter_unmatched_urls", TRUE);
+    cfg.modify_other_keys = cfg_bool("modify_other_keys", FALSE);
+    cfg.fullscreen = cfg_bool("fullscreen", TRUE);
+    cfg.search_index = cfg_bool("search_index", TRUE);
+    cfg.completion_tokens = get_config_integer(config, "options", "completion_tokens").get_value_or(200000);
+
+    if (auto s = get_config_std_string(config, "options", "browser")) {
+        cfg.browser = *s;
+    } else if (const char *browser = g_getenv("BROWSER")) {
+        cfg.browser = browser;
+    }
+    if (cfg.browser.empty()) {
+        cfg.browser = "xdg-open";
+    }
+
+    cfg.font = get_config_std_string(config, "options", "font");
+    cfg.icon_name = get_config_std_string(config, "options", "icon_name");
+    if (auto i = get_config_integer(config, "options", "scrollback_lines")) {
+        cfg.scrollback_lines = *i;
+    }
+    cfg.scrollback_bytes = 0;
+    if (auto s = get_config_string(config, "options", "scrollback_bytes")) {
+        cfg.scrollback_bytes = parse_size(*s);
+        g_free(*s);
+    }
+    cfg.memory_pressure = get_config_double(config, "options", "memory_pressure").get_value_or(0);
+    cfg.idle_reclaim = get_config_integer(config, "options", "idle_reclaim").get_value_or(300);
+
+    if (auto s = get_config_string(config, "options", "cursor_blink")) {
+        if (!g_ascii_strcasecmp(*s, "system")) {
+            cfg.cursor_blink = VTE_CURSOR_BLINK_SYSTEM;
+        } else if (!g_ascii_strcasecmp(*s, "on")) {
+            cfg.cursor_blink = VTE_CURSOR_BLINK_ON;
+        } else if (!g_ascii_strcasecmp(*s, "off")) {
+            cfg.cursor_blink = VTE_CURSOR_BLINK_OFF;
+        }
+        g_free(*s);
+    }
+
+    if (auto s = get_config_string(config, "options", "cursor_shape")) {
+        if (!g_ascii_strcasecmp(*s, "block")) {
+            cfg.cursor_shape = VTE_CURSOR_SHAPE_BLOCK;
+        } else if (!g_ascii_strcasecmp(*s, "ibeam")) {
+            cfg.cursor_shape = VTE_CURSOR_SHAPE_IBEAM;
+        } else if (!g_ascii_strcasecmp(*s, "underline")) {
+            cfg.cursor_shape = VTE_CURSOR_SHAPE_UNDERLINE;
+        }
+        g_free(*s);
+    }
+
+    cfg.scrollbar = scrollbar_position::off;
+    if (auto s = get_config_string(config, "options", "scrollbar")) {
+        // "off" is implicitly handled by default
+        if (!g_ascii_strcasecmp(*s, "left")) {
+            cfg.scrollbar = scrollbar_position::left;
+        } else if (!g_ascii_strcasecmp(*s, "right")) {
+            cfg.scrollbar = scrollbar_position::right;
+        }
+        g_free(*s);
+    }
+
+    cfg.palette = parse_palette(config);
+    cfg.foreground = get_config_color(config, "colors", "foreground");
+    cfg.foreground_bold = get_config_color(config, "colors", "foreground_bold");
+    cfg.background = get_config_color(config, "colors", "background");
+    cfg.cursor = get_config_color(config, "colors", "cursor");
+    cfg.cursor_foreground = get_config_color(config, "colors", "cursor_foreground");
+    cfg.highlight = get_config_color(config, "colors", "highlight");
+
+    cfg.hint_font = get_config_std_string(config, "hints", "font");
+    cfg.hint_fg = get_config_color(config, "hints", "foreground").get_value_or(GdkRGBA{1, 1, 1, 1});
+    cfg.hint_bg = get_config_color(config, "hints", "background").get_value_or(GdkRGBA{0, 0, 0, 1});
+    cfg.hint_af = get_config_color(config, "hints", "active_foreground").get_value_or(GdkRGBA{0.9, 0.5, 0.5, 1});
+    cfg.hint_ab = get_config_color(config, "hints", "active_background").get_value_or(GdkRGBA{0, 0, 0, 1});
+    cfg.hint_border = get_config_color(config, "hints", "border");
+    cfg.hint_padding = get_config_double(config, "hints", "padding", 5).get_value_or(2.0);
+    cfg.hint_border_width = get_config_double(config, "hints", "border_width").get_value_or(1.0);
+    cfg.hint_roundness = get_config_double(config, "hints", "roundness").get_value_or(1.5);
+    return cfg;
+}
+
+template<typename T>
+static bool same(const T &a, const T &b) {
+    return a == b;
+}
+
+static bool same(const GdkRGBA &a, const GdkRGBA &b) {
+    return gdk_rgba_equal(&a, &b);
+}
+
+static bool same(const std::array<GdkRGBA, 256> &a, const std::array<GdkRGBA, 256> &b) {
+    return std::equal(a.begin(), a.end(), b.begin(),
+                      [](const GdkRGBA &x, const GdkRGBA &y) { return same(x, y); });
+}
+
+template<typename T>
+static bool same(const maybe<T> &a, const maybe<T> &b) {
+    return static_cast<bool>(a) == static_cast<bool>(b) && (!a || same(*a, *b));
+}
+
+template<typename T>
+static bool changed(const config_snapshot *old, const config_snapshot &cfg, T config_snapshot::*field) {
+    return !old || !same(old->*field, cfg.*field);
+}
+
+bool same_hints(const config_snapshot &a, const config_snapshot &b) {
+    return same(a.hint_font, b.hint_font) && same(a.hint_fg, b.hint_fg) &&
+        same(a.hint_bg, b.hint_bg) && same(a.hint_af, b.hint_af) && same(a.hint_ab, b.hint_ab) &&
+        same(a.hint_border, b.hint_border) && a.hint_padding == b.hint_padding &&
+        a.hint_border_width == b.hint_border_width && a.hint_roundness == b.hint_roundness;
+}
+
+static cairo_pattern_t *create_pattern(const GdkRGBA &color) {
+    return cairo_pattern_create_rgba(color.red, color.green, color.blue, color.alpha);
+}
+
+static void free_hints(hint_info *hints) {
+    pango_font_description_free(hints->font);
+    for (cairo_pattern_t *pattern : {hints->fg, hints->bg, hints->af, hints->ab, hints->border}) {
+        cairo_pattern_destroy(pattern);
+    }
+}
+
+static void create_hints(const config_snapshot &cfg, hint_info *hints) {
+    hints->font = cfg.hint_font ? pango_font_description_from_string((*cfg.hint_font).c_str()) : nullptr;
+    hints->fg = create_pattern(cfg.hint_fg);
+    hints->bg = create_pattern(cfg.hint_bg);
+    hints->af = create_pattern(cfg.hint_af);
+    hints->ab = create_pattern(cfg.hint_ab);
+    hints->border = cfg.hint_border ? create_pattern(*cfg.hint_border) : cairo_pattern_reference(hints->fg);
+    hints->padding = cfg.hint_padding;
+    hints->border_width = cfg.hint_border_width;
+    hints->roundness = cfg.hint_roundness;
+}
+
+static void apply_theme(GtkWindow *window, VteTerminal *vte, const config_snapshot *old,
+                        const config_snapshot &cfg, hint_info &hints,
+                        GtkCssProvider **background_provider) {
+    // setting the palette resets every other color
+    const bool palette = changed(old, cfg, &config_snapshot::palette);
+    if (palette) {
+        vte_terminal_set_colors(vte, nullptr, nullptr, cfg.palette.data(), cfg.palette.size());
+    }
+    if (palette || changed(old, cfg, &config_snapshot::foreground) ||
+        changed(old, cfg, &config_snapshot::foreground_bold)) {
+        if (cfg.foreground) {
+            vte_terminal_set_color_foreground(vte, &*cfg.foreground);
+            vte_terminal_set_color_bold(vte, &*cfg.foreground);
+        }
+        if (cfg.foreground_bold) {
+            vte_terminal_set_color_bold(vte, &*cfg.foreground_bold);
+        }
+    }
+    if ((palette || changed(old, cfg, &config_snapshot::background)) && cfg.background) {
+        vte_terminal_set_color_background(vte, &*cfg.background);
+        if (!old || !same(old->background, cfg.background)) {
+            GdkRGBA background = *cfg.background;
+            override_background_color(GTK_WIDGET(window), &background, background_provider);
+        }
+    }
+    if ((palette || changed(old, cfg, &config_snapshot::cursor)) && cfg.cursor) {
+        vte_terminal_set_color_cursor(vte, &*cfg.cursor);
+    }
+    if ((palette || changed(old, cfg, &config_snapshot::cursor_foreground)) && cfg.cursor_foreground) {
+        vte_terminal_set_color_cursor_foreground(vte, &*cfg.cursor_foreground);
+    }
+    if ((palette || changed(old, cfg, &config_snapshot::highlight)) && cfg.highlight) {
+        vte_terminal_set_color_highlight(vte, &*cfg.highlight);
+    }
+
+    if (!old || !same_hints(*old, cfg)) {
+        free_hints(&hints);
+        create_hints(cfg, &hints);
+    }
+}
+
+// the files tried in order, until one of them loads
+static std::vector<std::string> config_candidates(const char *config_file) {
+    const std::string default_path = "/termite/config";
+    std::vector<std::string> paths;
+    if (config_file) {
+        paths.emplace_back(config_file);
+    }
+    paths.push_back(g_get_user_config_dir() + default_path);
+    for (const char *const *dir = g_get_system_config_dirs(); *dir; dir++) {
+        paths.push_back(*dir + default_path);
+    }
+    return paths;
+}
+
+static GKeyFile *read_config(const char *config_file) {
+    GKeyFile *config = g_key_file_new();
+    GError *error = nullptr;
+
+    gboolean loaded = FALSE;
+
+    for (const std::string &path : config_candidates(config_file)) {
+        loaded = g_key_file_load_from_file(config, path.c_str(), G_KEY_FILE_NONE, &error);
+        if (loaded) {
+            break;
+        }
+        g_printerr("%s parsing failed: %s\n", path.c_str(), error->message);
+        g_clear_error(&error);
+    }
+
+    if (!loaded) {
+        g_key_file_free(config);
+        return nullptr;
+    }
+    return config;
+}
+
+static void load_config(GtkWindow *window, VteTerminal *vte, GtkWidget *scrollbar,
+                        GtkWidget *hbox, config_info *info, char **icon,
+                        bool *show_scrollbar) {
+    // the daemon parses the config once and shares it between windows
+    if (resident_config) {
+        set_config(window, vte, scrollbar, hbox, info, icon, show_scrollbar, resident_config);
+        return;
+    }
+
+    GKeyFile *config = read_config(info->config_file);
+    profile_phase("config lookup");
+    if (config) {
+        set_config(window, vte, scrollbar, hbox, info, icon, show_scrollbar, config);
+        g_key_file_free(config);
+    }
+}
+
+// Only settings that differ from the previously applied snapshot are passed on, as setting the
+// font or the palette again redraws or reflows the whole terminal.
+static void apply_config(GtkWindow *window, VteTerminal *vte, GtkWidget *scrollbar, GtkWidget *hbox,
+                         config_info *info, char **icon, bool *show_scrollbar_ptr,
+                         const config_snapshot &cfg) {
+    const config_snapshot *old = info->applied.get();
+    auto option = [old, &cfg](gboolean config_snapshot::*field) {
+        return changed(old, cfg, field);
+    };
+
+    if (option(&config_snapshot::scroll_on_output)) {
+        vte_terminal_set_scroll_on_output(vte, cfg.scroll_on_output);
+    }
+    if (option(&config_snapshot::scroll_on_keystroke)) {
+        vte_terminal_set_scroll_on_keystroke(vte, cfg.scroll_on_keystroke);
+    }
+    if (option(&config_snapshot::audible_bell)) {
+        vte_terminal_set_audible_bell(vte, cfg.audible_bell);
+    }
+    if (option(&config_snapshot::mouse_autohide)) {
+        vte_terminal_set_mouse_autohide(vte, cfg.mouse_autohide);
+    }
+    if (option(&config_snapshot::allow_bold)) {
+        vte_terminal_set_allow_bold(vte, cfg.allow_bold);
+    }
+    if (option(&config_snapshot::search_wrap)) {
+        vte_terminal_search_set_wrap_around(vte, cfg.search_wrap);
+    }
+#if VTE_CHECK_VERSION (0, 49, 1)
+    if (option(&config_snapshot::hyperlinks)) {
+        vte_terminal_set_allow_hyperlink(vte, cfg.hyperlinks);
+    }
+#endif
+#if VTE_CHECK_VERSION (0, 51, 2)
+    if (option(&config_snapshot::bold_is_bright)) {
+        vte_terminal_set_bold_is_bright(vte, cfg.bold_is_bright);
+    }
+    if (changed(old, cfg, &config_snapshot::cell_height_scale)) {
+        vte_terminal_set_cell_height_scale(vte, cfg.cell_height_scale);
+    }
+    if (changed(old, cfg, &config_snapshot::cell_width_scale)) {
+        vte_terminal_set_cell_width_scale(vte, cfg.cell_width_scale);
+    }
+#endif
+    info->search_wrap = cfg.search_wrap;
+    info->dynamic_title = cfg.dynamic_title;
+    info->urgent_on_bell = cfg.urgent_on_bell;
+    info->clickable_url = cfg.clickable_url;
+    info->size_hints = cfg.size_hints;
+    info->filter_unmatched_urls = cfg.filter_unmatched_urls;
+    info->modify_other_keys = cfg.modify_other_keys;
+    info->fullscreen = cfg.fullscreen;
+    info->search_index = cfg.search_index;
+    info->completion_tokens = cfg.completion_tokens;
+    info->font_scale = vte_terminal_get_font_scale(vte);
+
+    if (changed(old, cfg, &config_snapshot::browser)) {
+        g_free(info->browser);
+        info->browser = g_strdup(cfg.browser.c_str());
+    }
+
+    if (option(&config_snapshot::clickable_url)) {
+        if (info->tag != -1) {
+            vte_terminal_match_remove(vte, info->tag);
+            info->tag = -1;
+        }
+
+        if (info->clickable_url) {
+            VteRegex *match_regex = get_vte_regex(url_regex, PCRE2_MULTILINE | PCRE2_NOTEMPTY, false);
+            if (match_regex) {
+                info->tag = vte_terminal_match_add_regex(vte, match_regex, 0);
+                vte_terminal_match_set_cursor_name(vte, info->tag, "hand");
+            }
+        }
+    }
+
+    // settings left out of the config keep their current value
+    const bool font = changed(old, cfg, &config_snapshot::font) && cfg.font;
+    if (font) {
+        PangoFontDescription *desc = pango_font_description_from_string((*cfg.font).c_str());
+        vte_terminal_set_font(vte, desc);
+        pango_font_description_free(desc);
+    }
+
+    if (changed(old, cfg, &config_snapshot::scrollback_lines) && cfg.scrollback_lines) {
+        keep_clipboard_text(vte);
+        vte_terminal_set_scrollback_lines(vte, *cfg.scrollback_lines);
+    }
+
+    if (changed(old, cfg, &config_snapshot::cursor_blink) && cfg.cursor_blink) {
+        vte_terminal_set_cursor_blink_mode(vte, *cfg.cursor_blink);
+    }
+
+    if (changed(old, cfg, &config_snapshot::cursor_shape) && cfg.cursor_shape) {
+        vte_terminal_set_cursor_shape(vte, *cfg.cursor_shape);
+    }
+
+    if (icon && cfg.icon_name) {
+        *icon = g_strdup((*cfg.icon_name).c_str());
+    }
+
+    if (info->size_hints && (font || option(&config_snapshot::size_hints) ||
+                             changed(old, cfg, &config_snapshot::cell_height_scale) ||
+                             changed(old, cfg, &config_snapshot::cell_width_scale))) {
+        set_size_hints(GTK_WINDOW(window), vte);
+    }
+
+    const bool show_scrollbar = cfg.scrollbar != scrollbar_position::off;
+    if (changed(old, cfg, &config_snapshot::scrollbar)) {
+        if (show_scrollbar) {
+            gtk_box_reorder_child(GTK_BOX(hbox), scrollbar,
+                                  cfg.scrollbar == scrollbar_position::left ? 0 : -1);
+            gtk_widget_show(scrollbar);
+        } else {
+            gtk_widget_hide(scrollbar);
+        }
+    }
+    if (show_scrollbar_ptr != nullptr) {
+        *show_scrollbar_ptr = show_scrollbar;
+    }
+
+    profile_phase("settings");
+    apply_theme(window, vte, old, cfg, info->hints, &info->background);
+    profile_phase("theme");
+
+    if (old) {
+        *info->applied = cfg;
+    } else {
+        info->applied.reset(new config_snapshot(cfg));
+    }
+}
+
+static void set_config(GtkWindow *window, VteTerminal *vte, GtkWidget *scrollbar, GtkWidget *hbox,
+                       config_info *info, char **icon, bool *show_scrollbar_ptr,
+                       GKeyFile *config) {
+    const config_snapshot cfg = parse_config(config);
+    profile_phase("config parse");
+    apply_config(window, vte, scrollbar, hbox, info, icon, show_scrollbar_ptr, cfg);
+}/*}}}*/
+
+static void quit_process(int status) {
+    if (stats_file) {
+        dump_latency_stats();
+    }
+    gtk_main_quit();
+    exit(status);
+}
+
+static void exit_with_status(VteTerminal *, int status) {
+    quit_process(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+}
+
+static void exit_with_success(VteTerminal *) {
+    quit_process(EXIT_SUCCESS);
+}
+
+static void close_window(VteTerminal *vte) {
+    gtk_widget_destroy(gtk_widget_get_toplevel(GTK_WIDGET(vte)));
+}
+
+static void destroy_window(GtkWidget *, window_info *win) {
+    // a daemon keeps running, the statistics are written once no window is left
+    if (stats_file && windows.size() == 1) {
+        dump_latency_stats();
+    }
+    windows.erase(std::find(windows.begin(), windows.end(), win));
+    update_scrollback_budget();
+    g_free(win->keybind.config.browser);
+    free_hints(&win->keybind.config.hints);
+    free(win->keybind.panel.fulltext);
+    clear_marker_cache(&win->keybind.panel);
+    if (TermiteTokenModel *model = win->keybind.panel.token_model) {
+        model->index = nullptr; // the completion may outlive the window state
+        g_object_unref(model);
+    }
+    if (win->keybind.panel.search.idle_source) {
+        g_source_remove(win->keybind.panel.search.idle_source);
+    }
+    cancel_search(&win->keybind.panel.search);
+    cancel_paste(&win->keybind);
+    g_cancellable_cancel(win->keybind.spawn);
+    g_object_unref(win->keybind.spawn);
+    if (win->keybind.idle.timer) {
+        g_source_remove(win->keybind.idle.timer);
+    }
+    g_signal_handler_disconnect(win->keybind.latency.clock, win->keybind.latency.paint_handler);
+    select_info &select = win->keybind.select;
+    if (select.tick) {
+        gtk_widget_remove_tick_callback(GTK_WIDGET(win->keybind.vte), select.tick);
+    }
+    release_clipboard(&select, false);
+    delete win;
+}
+
+static void apply_panel_config(keybind_info *info) {
+    info->panel.tokens.limit = (size_t)std::max(info->config.completion_tokens, 1l);
+
+    search_index *index = &info->panel.search;
+    index->wrap = info->config.search_wrap;
+    index->enabled = info->config.search_index;
+    if (!index->enabled) {
+        if (index->idle_source) {
+            g_source_remove(index->idle_source);
+            index->idle_source = 0;
+        }
+        reset_search_index(index, 0, 0);
+        index->postings.rehash(0);
+    }
+}
+
+static void resize_warm_pool();
+
+static void apply_reloaded_config(GKeyFile *config, const config_snapshot &cfg) {
+    if (resident_config) {
+        g_key_file_free(resident_config);
+    }
+    resident_config = daemon_mode ? config : nullptr;
+    resize_warm_pool();
+
+    // every window reads the same file, so it is only parsed once
+    for (window_info *win : windows) {
+        config_info &info = win->keybind.config;
+        // markers are drawn with the terminal font unless hint_font is set
+        const bool hints = !info.applied || !same_hints(*info.applied, cfg) ||
+                           changed(info.applied.get(), cfg, &config_snapshot::font);
+        apply_config(win->keybind.window, win->keybind.vte, win->scrollbar, win->hbox,
+                     &info, nullptr, nullptr, cfg);
+        win->draw.filter_unmatched_urls = info.filter_unmatched_urls;
+        apply_panel_config(&win->keybind);
+        if (hints) {
+            clear_marker_cache(&win->keybind.panel);
+        }
+    }
+    update_scrollback_budget();
+    if (!resident_config) {
+        g_key_file_free(config);
+    }
+}
+
+/* {{{ IDLE RECLAIM */
+static const size_t hash_node_bytes = 32; // the node and the bucket pointing at it
+
+// A rough count of the heap held by the caches of a window that are reclaimed.
+static size_t cache_bytes(const keybind_info *info) {
+    size_t bytes = 0;
+    for (const auto &row : info->select.rows.rows) {
+        bytes += sizeof(row) + hash_node_bytes +
+                 row.second.codepoints.capacity() * sizeof(gunichar) +
+                 row.second.columns.capacity() * sizeof(long);
+    }
+    bytes += info->select.rows.lines.size() *
+             (sizeof(std::map<long, line_bounds>::value_type) + hash_node_bytes);
+    for (const url_line &line : info->panel.urls.lines) {
+        bytes += sizeof(line) + line.text.capacity();
+        for (const url_match &match : line.matches) {
+            bytes += sizeof(match) + match.url.capacity();
+        }
+    }
+    for (const auto &marker : info->panel.markers) {
+        bytes += (size_t)(marker.second.width * marker.second.height) * 4;
+    }
+    const search_index &search = info->panel.search;
+    for (const auto &posting : search.postings) {
+        bytes += sizeof(posting) + hash_node_bytes + posting.second.data.capacity();
+    }
+    return bytes + search.matches.capacity() * sizeof(search_match);
+}
+
+static gint64 resident_bytes() {
+    char *contents;
+    if (!g_file_get_contents("/proc/self/statm", &contents, nullptr, nullptr)) {
+        return 0;
+    }
+    long size, resident = 0;
+    if (sscanf(contents, "%ld %ld", &size, &resident) != 2) {
+        resident = 0;
+    }
+    g_free(contents);
+    return (gint64)resident * sysconf(_SC_PAGESIZE);
+}
+
+// Drop what a window only keeps to respond quickly. Rows, urls and markers are rebuilt when
+// they are next read, the search index and the hint patterns on focus. The completion tokens
+// are kept, as they are bounded by completion_tokens and rebuilding them reads the whole
+// history.
+static void reclaim_caches(keybind_info *info) {
+    const gint64 resident = resident_bytes();
+    const size_t bytes = cache_bytes(info);
+
+    clear_row_cache(&info->select.rows);
+    info->select.rows.rows.rehash(0);
+
+    search_panel_info &panel = info->panel;
+    std::vector<url_line>().swap(panel.urls.lines);
+    panel.urls.dirty = true;
+    clear_marker_cache(&panel);
+
+    search_index &search = panel.search;
+    if (search.idle_source) {
+        g_source_remove(search.idle_source);
+        search.idle_source = 0;
+    }
+    reset_search_index(&search, 0, 0);
+    search.postings.rehash(0);
+    std::vector<search_match>().swap(search.matches);
+
+    hint_info &hints = info->config.hints;
+    free_hints(&hints);
+    hints.font = nullptr;
+    hints.fg = hints.bg = hints.af = hints.ab = hints.border = nullptr;
+
+    info->idle.reclaimed = true;
+    if (std::all_of(windows.begin(), windows.end(),
+                    [](window_info *win) { return win->keybind.idle.reclaimed; })) {
+        release_pcre_regexes();
+    }
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+
+    reclaimed_bytes += bytes;
+    const char *title = gtk_window_get_title(info->window);
+    g_debug("reclaimed about %zu bytes of caches from idle window \"%s\", resident set "
+            "%" G_GINT64_FORMAT " -> %" G_GINT64_FORMAT " bytes",
+            bytes, title ? title : "", resident, resident_bytes());
+}
+
+static void restore_caches(keybind_info *info) {
+    info->idle.reclaimed = false;
+    hint_info &hints = info->config.hints;
+    if (!hints.fg && info->config.applied) {
+        create_hints(*info->config.applied, &hints);
+    }
+    schedule_search_index(info);
+}
+
+static gboolean idle_reclaim_cb(keybind_info *info) {
+    if (info->panel.mode != overlay_mode::hidden || info->select.mode != vi_mode::insert ||
+        info->paste.watch || info->panel.search.task) {
+        return G_SOURCE_CONTINUE; // still in use, try again after another interval
+    }
+    info->idle.timer = 0;
+    reclaim_caches(info);
+    return G_SOURCE_REMOVE;
+}
+
+gboolean focus_cb(GtkWindow *window, GdkEventFocus *event, keybind_info *info) {
+    gtk_window_set_urgency_hint(window, FALSE);
+
+    idle_info &idle = info->idle;
+    if (idle.timer) {
+        g_source_remove(idle.timer);
+        idle.timer = 0;
+    }
+    if (event->in) {
+        if (idle.reclaimed) {
+            restore_caches(info);
+        }
+    } else if (!idle.reclaimed) {
+        const config_snapshot *cfg = info->config.applied.get();
+        if (cfg && cfg->idle_reclaim > 0) {
+            idle.timer = g_timeout_add_seconds((guint)cfg->idle_reclaim,
+                                               (GSourceFunc)idle_reclaim_cb, info);
+        }
+    }
+    return FALSE;
+}
+/* }}} */
+
+/* {{{ CONFIG RELOAD */
+static const guint config_debounce_ms = 200;
+
+struct config_load {
+    ~config_load() {
+        if (config) {
+            g_key_file_free(config);
+        }
+    }
+    GKeyFile *config;
+    config_snapshot cfg;
+};
+
+struct config_reload {
+    bool running, queued;
+    guint debounce;
+    std::vector<std::string> watched;
+    std::vector<GFileMonitor *> monitors;
+};
+
+static config_reload reload_state {false, false, 0, std::vector<std::string>(),
+                                   std::vector<GFileMonitor *>()};
+
+static void watch_config();
+
+// Reading and parsing the file only touches GKeyFile and GDK color parsing, so it stays off
+// the main loop, which only has to apply the result.
+static void read_config_thread(GTask *task, gpointer, gpointer, GCancellable *) {
+    GKeyFile *config = read_config(config_path);
+    if (!config) {
+        g_task_return_pointer(task, nullptr, nullptr);
+        return;
+    }
+    g_task_return_pointer(task, new config_load{config, parse_config(config)},
+                          [](gpointer load) { delete static_cast<config_load *>(load); });
+}
+
+static void config_loaded_cb(GObject *, GAsyncResult *result, gpointer) {
+    std::unique_ptr<config_load> load(
+        static_cast<config_load *>(g_task_propagate_pointer(G_TASK(result), nullptr)));
+    if (load) {
+        apply_reloaded_config(load->config, load->cfg);
+        load->config = nullptr;
+    }
+    reload_state.running = false;
+    watch_config(); // the file may now be found elsewhere
+    if (reload_state.queued) {
+        reload_state.queued = false;
+        reload_config();
+    }
+}
+
+void reload_config() {
+    if (reload_state.running) {
+        reload_state.queued = true;
+        return;
+    }
+    reload_state.running = true;
+    GTask *task = g_task_new(nullptr, nullptr, config_loaded_cb, nullptr);
+    g_task_run_in_thread(task, read_config_thread);
+    g_object_unref(task);
+}
+
+static gboolean reload_signal_cb(gpointer) {
+    reload_config();
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean config_debounce_cb(gpointer) {
+    reload_state.debounce = 0;
+    reload_config();
+    return G_SOURCE_REMOVE;
+}
+
+// Editors and dotfile managers often write a file in several steps, so wait for them to settle.
+static void config_changed_cb(GFileMonitor *, GFile *, GFile *, GFileMonitorEvent event, gpointer) {
+    if (event == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED) {
+        return;
+    }
+    if (reload_state.debounce) {
+        g_source_remove(reload_state.debounce);
+    }
+    reload_state.debounce = g_timeout_add(config_debounce_ms, config_debounce_cb, nullptr);
+}
+
+// Watch the file that would be loaded, along with the target of a symlink to it.
+static void watch_config() {
+    const std::vector<std::string> candidates = config_candidates(config_path);
+    std::string path = candidates.front();
+    for (const std::string &candidate : candidates) {
+        if (g_file_test(candidate.c_str(), G_FILE_TEST_EXISTS)) {
+            path = candidate;
+            break;
+        }
+    }
+
+    std::vector<std::string> watched{path};
+    if (char *target = realpath(path.c_str(), nullptr)) {
+        if (path != target) {
+            watched.emplace_back(target);
+        }
+        free(target);
+    }
+    if (watched == reload_state.watched) {
+        return;
+    }
+
+    for (GFileMonitor *monitor : reload_state.monitors) {
+        g_object_unref(monitor);
+    }
+    reload_state.monitors.clear();
+    for (const std::string &file_path : watched) {
+        GFile *file = g_file_new_for_path(file_path.c_str());
+        GError *error = nullptr;
+        GFileMonitor *monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE, nullptr, &error);
+        g_object_unref(file);
+        if (!monitor) {
+            g_printerr("failed to watch %s: %s\n", file_path.c_str(), error->message);
+            g_error_free(error);
+            continue;
+        }
+        g_signal_connect(monitor, "changed", G_CALLBACK(config_changed_cb), nullptr);
+        reload_state.monitors.push_back(monitor);
+    }
+    reload_state.watched = std::move(watched);
+}
+
+static void setup_config_reload() {
+    g_unix_signal_add(SIGUSR1, reload_signal_cb, nullptr);
+    watch_config();
+}
+/* }}} */
+
+static char *get_user_shell_with_fallback() {
+    if (const char *env = g_getenv("SHELL") ) {
+        if (!((env != NULL) && (env[0] == '\0')))
+            return g_strdup(env);
+    }
+
+    if (char *command = vte_get_user_shell()) {
+        if (!((command != NULL) && (command[0] == '\0')))
+           return command;
+    }
+
+    return g_strdup("/bin/sh");
+}
+
+static void on_alpha_screen_changed(GtkWindow *window, GdkScreen *, void *) {
+    GdkScreen *screen = gtk_widget_get_screen(GTK_WIDGET(window));
+    GdkVisual *visual = gdk_screen_get_rgba_visual(screen);
+
+    if (!visual)
+        visual = gdk_screen_get_system_visual(screen);
+
+    gtk_widget_set_visual(GTK_WIDGET(window), visual);
+}
+
+static bool open_display() {
+    GdkDisplay *display = gdk_display_open(gdk_get_display_arg_name());
+    if (!display) {
+        g_printerr("cannot open display\n");
+        return false;
+    }
+    gdk_display_manager_set_default_display(gdk_display_manager_get(), display);
+    return true;
+}
+
+#if VTE_CHECK_VERSION (0, 48, 0)
+static void spawn_failed(VteTerminal *vte, GError *error) {
+    g_printerr("the command failed to run: %s\n", error->message);
+    if (daemon_mode) {
+        close_window(vte);
+    } else {
+        quit_process(EXIT_FAILURE);
+    }
+}
+
+struct child_spawn {
+    VteTerminal *vte;
+    VtePty *pty;
+    GCancellable *cancellable; // cancelled when the window is destroyed first
+};
+
+static void reap_child(GPid pid, gint, gpointer) {
+    g_spawn_close_pid(pid);
+}
+
+static void spawn_cb(GObject *, GAsyncResult *result, gpointer data) {
+    std::unique_ptr<child_spawn> spawn(static_cast<child_spawn *>(data));
+    GError *error = nullptr;
+    GPid pid;
+    const bool spawned = vte_pty_spawn_finish(spawn->pty, result, &pid, &error);
+    if (g_cancellable_is_cancelled(spawn->cancellable)) {
+        if (spawned) {
+            kill(pid, SIGHUP); // started just as the window went away
+            g_child_watch_add(pid, reap_child, nullptr);
+        } else {
+            g_error_free(error);
+        }
+    } else if (spawned) {
+        vte_terminal_watch_child(spawn->vte, pid);
+    } else {
+        spawn_failed(spawn->vte, error);
+        g_error_free(error);
+    }
+    g_object_unref(spawn->pty);
+    g_object_unref(spawn->cancellable);
+}
+#endif
+
+static char **child_environ() {
+    return g_environ_setenv(g_get_environ(), "TERM", "xterm-termite", TRUE);
+}
+
+static bool spawn_child(GtkWidget *window, VteTerminal *vte, const char *directory,
+                        char **command_argv, GCancellable *cancellable) {
+    char **env = child_environ();
+
+#ifdef GDK_WINDOWING_X11
+    if (GDK_IS_X11_SCREEN(gtk_widget_get_screen(window))) {
+        GdkWindow *gdk_window = gtk_widget_get_window(window);
+        if (!gdk_window) {
+            g_printerr("no window\n");
+            g_strfreev(env);
+            return false;
+        }
+        char xid_s[std::numeric_limits<long unsigned>::digits10 + 1];
+        snprintf(xid_s, sizeof(xid_s), "%lu", GDK_WINDOW_XID(gdk_window));
+        env = g_environ_setenv(env, "WINDOWID", xid_s, TRUE);
+    }
+#endif
+
+#if VTE_CHECK_VERSION (0, 48, 0)
+    if (record_file) {
+        const bool started = start_recording(vte, directory, command_argv, env);
+        g_strfreev(env);
+        return started;
+    }
+
+    GError *error = nullptr;
+    VtePty *pty = vte_terminal_pty_new_sync(vte, VTE_PTY_DEFAULT, cancellable, &error);
+    if (!pty) {
+        g_printerr("failed to open a pty: %s\n", error->message);
+        g_error_free(error);
+        g_strfreev(env);
+        return false;
+    }
+
+    // The pty is attached before the fork, so input typed while the child starts up is queued
+    // by the line discipline and read once the shell is running.
+    vte_terminal_set_pty(vte, pty);
+    vte_pty_spawn_async(pty, directory, command_argv, env, G_SPAWN_SEARCH_PATH, nullptr, nullptr,
+                        nullptr, -1, cancellable, spawn_cb,
+                        new child_spawn{vte, pty, G_CANCELLABLE(g_object_ref(cancellable))});
+    g_strfreev(env);
+    return true;
+#else
+    GError *error = nullptr;
+    GPid child_pid;
+    const bool spawned = vte_terminal_spawn_sync(vte, VTE_PTY_DEFAULT, directory, command_argv, env,
+                                                 G_SPAWN_SEARCH_PATH, nullptr, nullptr, &child_pid,
+                                                 cancellable, &error);
+    if (spawned) {
+        vte_terminal_watch_child(vte, child_pid);
+    } else {
+        g_printerr("the command failed to run: %s\n", error->message);
+        g_error_free(error);
+    }
+
+    g_strfreev(env);
+    return spawned;
+#endif
+}
+
+/* {{{ WARM SHELLS */
+// Shells started ahead of time by the daemon on their own pty, so a new window only has to
+// attach one. Their output, such as the first prompt, waits in the pty until then.
+struct warm_shell {
+    VtePty *pty;
+    GPid pid;
+    guint watch;
+    std::string directory;
+};
+
+struct warm_pool {
+    std::vector<warm_shell> shells;
+    size_t size;
+    size_t starting;
+    std::string directory; // where replacements are started
+};
+
+static warm_pool warm_shells {std::vector<warm_shell>(), 0, 0, std::string()};
+
+static void fill_warm_pool();
+
+static void warm_shell_exited_cb(GPid pid, gint, gpointer) {
+    auto it = std::find_if(warm_shells.shells.begin(), warm_shells.shells.end(),
+                           [pid](const warm_shell &shell) { return shell.pid == pid; });
+    if (it != warm_shells.shells.end()) {
+        g_object_unref(it->pty);
+        warm_shells.shells.erase(it);
+    }
+    g_spawn_close_pid(pid);
+}
+
+#if VTE_CHECK_VERSION (0, 48, 0)
+struct warm_spawn {
+    VtePty *pty;
+    std::string directory;
+};
+
+static void warm_shell_spawned_cb(GObject *, GAsyncResult *result, gpointer data) {
+    std::unique_ptr<warm_spawn> spawn(static_cast<warm_spawn *>(data));
+    warm_shells.starting--;
+    GError *error = nullptr;
+    GPid pid;
+    if (!vte_pty_spawn_finish(spawn->pty, result, &pid, &error)) {
+        g_printerr("failed to start a warm shell: %s\n", error->message);
+        g_error_free(error);
+        g_object_unref(spawn->pty);
+        return;
+    }
+    if (warm_shells.shells.size() >= warm_shells.size) {
+        kill(pid, SIGHUP);
+        g_child_watch_add(pid, warm_shell_exited_cb, nullptr);
+        g_object_unref(spawn->pty);
+        return;
+    }
+    const guint watch = g_child_watch_add(pid, warm_shell_exited_cb, nullptr);
+    warm_shells.shells.push_back({spawn->pty, pid, watch, spawn->directory});
+}
+
+static void start_warm_shell() {
+    GError *error = nullptr;
+    VtePty *pty = vte_pty_new_sync(VTE_PTY_DEFAULT, nullptr, &error);
+    if (!pty) {
+        g_printerr("failed to open a pty: %s\n", error->message);
+        g_error_free(error);
+        return;
+    }
+    vte_pty_set_size(pty, 24, 80, nullptr);
+
+    char *argv[] = {get_user_shell_with_fallback(), nullptr};
+    char **env = child_environ();
+    const char *directory = warm_shells.directory.empty() ? nullptr : warm_shells.directory.c_str();
+    warm_shells.starting++;
+    vte_pty_spawn_async(pty, directory, argv, env, G_SPAWN_SEARCH_PATH, nullptr, nullptr, nullptr,
+                        -1, nullptr, warm_shell_spawned_cb,
+                        new warm_spawn{pty, warm_shells.directory});
+    g_strfreev(env);
+    g_free(argv[0]);
+}
+#endif
+
+static gboolean fill_warm_pool_cb(gpointer) {
+    fill_warm_pool();
+    return G_SOURCE_REMOVE;
+}
+
+void fill_warm_pool() {
+#if VTE_CHECK_VERSION (0, 48, 0)
+    while (warm_shells.shells.size() + warm_shells.starting < warm_shells.size) {
+        start_warm_shell();
+    }
+#endif
+}
+
+// Follows the warm_shells option of the daemon's config.
+static void resize_warm_pool() {
+    if (!daemon_mode) {
+        return;
+    }
+    int size = 0;
+    if (resident_config) {
+        size = get_config_integer(resident_config, "options", "warm_shells").get_value_or(0);
+    }
+    warm_shells.size = (size_t)std::max(size, 0);
+    while (warm_shells.shells.size() > warm_shells.size) {
+        warm_shell &shell = warm_shells.shells.back();
+        kill(shell.pid, SIGHUP); // the watch stays to reap it
+        g_object_unref(shell.pty);
+        warm_shells.shells.pop_back();
+    }
+    fill_warm_pool();
+}
+
+// Attach a warm shell to the terminal, preferring one already in the requested directory. The
+// others are moved there the way a user would, with a cd typed into the shell.
+static bool adopt_warm_shell(VteTerminal *vte, const char *directory) {
+    if (warm_shells.shells.empty()) {
+        return false;
+    }
+    auto it = warm_shells.shells.begin();
+    if (directory) {
+        auto match = std::find_if(warm_shells.shells.begin(), warm_shells.shells.end(),
+                                  [directory](const warm_shell &shell) {
+                                      return shell.directory == directory;
+                                  });
+        if (match != warm_shells.shells.end()) {
+            it = match;
+        }
+    }
+    warm_shell shell = *it;
+    warm_shells.shells.erase(it);
+
+    g_source_remove(shell.watch);
+    vte_terminal_set_pty(vte, shell.pty);
+    g_object_unref(shell.pty);
+    vte_terminal_watch_child(vte, shell.pid);
+
+    if (directory && shell.directory != directory) {
+        auto quoted = make_unique(g_shell_quote(directory), g_free);
+        // the leading space keeps it out of the history of shells ignoring such commands
+        auto command = make_unique(g_strdup_printf(" cd -- %s && clear\r", quoted.get()), g_free);
+        vte_terminal_feed_child(vte, command.get(), -1);
+    }
+
+    if (directory) {
+        warm_shells.directory = directory;
+    }
+    g_idle_add_full(G_PRIORITY_LOW, fill_warm_pool_cb, nullptr, nullptr);
+    return true;
+}
+/* }}} */
+
+window_info *create_window(window_options *opts) {
+    GError *error = nullptr;
+    char *icon = g_strdup(opts->icon);
+    bool show_scrollbar = false;
+
+    char **command_argv;
+    char *default_argv[2] = {nullptr, nullptr};
+
+    if (opts->execute) {
+        int argcp;
+        char **argvp;
+        g_shell_parse_argv(opts->execute, &argcp, &argvp, &error);
+        if (error) {
+            g_printerr("failed to parse command: %s\n", error->message);
+            g_error_free(error);
+            g_free(icon);
+            return nullptr;
+        }
+        command_argv = argvp;
+    } else {
+        default_argv[0] = get_user_shell_with_fallback();
+        command_argv = default_argv;
+    }
+
+    GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+
+    GtkWidget *panel_overlay = gtk_overlay_new();
+    GtkWidget *hint_overlay = gtk_overlay_new();
+
+    GtkWidget *vte_widget = vte_terminal_new();
+    VteTerminal *vte = VTE_TERMINAL(vte_widget);
+
+    GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_style_context_add_class(gtk_widget_get_style_context(hbox),"termite");
+    GtkWidget *scrollbar = gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(vte_widget)));
+    gtk_box_pack_start(GTK_BOX(hbox), hint_overlay, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), scrollbar, FALSE, FALSE, 0);
+
+    if (opts->role) {
+        gtk_window_set_role(GTK_WINDOW(window), opts->role);
+    }
+
+    window_info *win = new window_info {
+        {GTK_WINDOW(window), vte,
+         {nullptr,
+          nullptr,
+          overlay_mode::hidden,
+          std::vector<url_data>(),
+          nullptr,
+          {std::vector<url_line>(), 0, true},
+          std::map<std::pair<std::string, bool>, hint_marker>(),
+          0,
+          {std::unordered_map<std::string, token_stats>(),
+           std::vector<const std::string *>(),
+           std::vector<const std::string *>(),
+           std::vector<std::string>(),
+           0, 0, 200000},
+          nullptr,
+          {std::unordered_map<uint32_t, posting_list>(), 0, 0, 0, 0, true, true,
+           std::string(), std::vector<search_match>(), 0, false, 0, 0, nullptr},
+          panel_overlay, hint_overlay, nullptr, nullptr},
+         {vi_mode::insert, 0, 0, 0, 0, {std::unordered_map<long, decoded_row>(),
+                                           std::map<long, line_bounds>(), 0, 0}, 0,
+          {nullptr, 0, 0, 0, 0, false}, 0, 0,
+          {{nullptr, 0, 0, 0, 0, false}, std::string(), 0, 0}, false},
+         {{nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, 0, 0, 0},
+          nullptr, FALSE, FALSE, FALSE, FALSE, TRUE, FALSE, FALSE, TRUE, TRUE, -1, config_path, 0, 200000, nullptr,
+          nullptr},
+         gtk_window_fullscreen,
+         {std::deque<std::pair<std::string, bool>>(), 0, 0, 0, 0, false, false},
+         {0, latency_path::insert, false, false, nullptr, 0},
+         {std::numeric_limits<long>::min(), 0, 0, 0, false, -1},
+         {0, false},
+         g_cancellable_new()},
+        {vte, nullptr, nullptr, FALSE},
+        scrollbar, hbox
+    };
+    keybind_info &info = win->keybind;
+    info.panel.keybind = &info;
+    info.panel.draw = &win->draw;
+    windows.push_back(win);
+    update_scrollback_budget();
+    profile_phase("window");
+
+    load_config(GTK_WINDOW(window), vte, scrollbar, hbox, &info.config,
+                icon ? nullptr : &icon, &show_scrollbar);
+    apply_panel_config(&info);
+
+    GdkRGBA transparent {0, 0, 0, 0};
+
+    override_background_color(hint_overlay, &transparent);
+
+    gtk_container_add(GTK_CONTAINER(panel_overlay), hbox);
+    gtk_container_add(GTK_CONTAINER(hint_overlay), vte_widget);
+    gtk_container_add(GTK_CONTAINER(window), panel_overlay);
+
+    if (daemon_mode) {
+        if (!opts->hold) {
+            g_signal_connect(vte, "child-exited", G_CALLBACK(close_window), nullptr);
+        }
+        g_signal_connect(window, "destroy", G_CALLBACK(destroy_window), win);
+    } else {
+        if (!opts->hold) {
+            g_signal_connect_swapped(vte, "child-exited", G_CALLBACK(exit_release_clipboard),
+                                     &info.select);
+            g_signal_connect(vte, "child-exited", G_CALLBACK(exit_with_status), nullptr);
+        }
+        g_signal_connect_swapped(window, "destroy", G_CALLBACK(exit_release_clipboard), &info.select);
+        g_signal_connect(window, "destroy", G_CALLBACK(exit_with_success), nullptr);
+    }
+    g_signal_connect(vte, "key-press-event", G_CALLBACK(key_press_cb), &info);
+    g_signal_connect(panel_overlay, "get-child-position", G_CALLBACK(position_overlay_cb), nullptr);
+    g_signal_connect(vte, "button-press-event", G_CALLBACK(button_press_cb), &info.config);
+    g_signal_connect(vte, "bell", G_CALLBACK(bell_cb), &info.config.urgent_on_bell);
+    g_signal_connect_swapped(vte, "contents-changed", G_CALLBACK(invalidate_url_index), &info.panel);
+    GtkAdjustment *vadjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(vte));
+    g_signal_connect_swapped(vadjustment, "value-changed", G_CALLBACK(invalidate_url_index), &info.panel);
+    g_signal_connect_swapped(vadjustment, "changed", G_CALLBACK(invalidate_url_index), &info.panel);
+    g_signal_connect_swapped(vte, "contents-changed", G_CALLBACK(schedule_search_index), &info);
+    g_signal_connect_swapped(vte, "contents-changed", G_CALLBACK(row_cache_contents_changed), &info);
+    g_signal_connect_swapped(vte, "contents-changed", G_CALLBACK(selection_contents_changed), &info.select);
+    // runs before the window is laid out, and with it the terminal rewrapped
+    g_signal_connect_swapped(window, "check-resize", G_CALLBACK(release_clipboard_cb), &info.select);
+    win->draw = {vte, &info.panel, &info.config.hints, info.config.filter_unmatched_urls};
+
+    g_signal_connect(window, "focus-in-event",  G_CALLBACK(focus_cb), &info);
+    g_signal_connect(window, "focus-out-event", G_CALLBACK(focus_cb), &info);
+
+    on_alpha_screen_changed(GTK_WINDOW(window), nullptr, nullptr);
+    g_signal_connect(window, "screen-changed", G_CALLBACK(on_alpha_screen_changed), nullptr);
+
+    if (info.config.fullscreen) {
+        g_signal_connect(window, "window-state-event", G_CALLBACK(window_state_cb), &info);
+    }
+
+    if (opts->title) {
+        info.config.dynamic_title = FALSE;
+        gtk_window_set_title(GTK_WINDOW(window), opts->title);
+    } else {
+        g_signal_connect(vte, "window-title-changed", G_CALLBACK(window_title_cb),
+                         &info.config.dynamic_title);
+        if (opts->execute) {
+            gtk_window_set_title(GTK_WINDOW(window), opts->execute);
+        } else {
+            window_title_cb(vte, &info.config.dynamic_title);
+        }
+    }
+
+    if (icon) {
+        gtk_window_set_icon_name(GTK_WINDOW(window), icon);
+        g_free(icon);
+    }
+
+    gtk_widget_grab_focus(vte_widget);
+    gtk_widget_show_all(window);
+    watch_latency(&info);
+    if (!show_scrollbar) {
+        gtk_widget_hide(scrollbar);
+    }
+    profile_phase("widget tree");
+    if (startup_profile) {
+        g_signal_connect(gtk_widget_get_frame_clock(window), "after-paint",
+                         G_CALLBACK(first_paint_cb), nullptr);
+    }
+
+    // a benchmark feeds the terminal itself instead of running a child
+    const bool spawned = bench_file ||
+        (!opts->execute && adopt_warm_shell(vte, opts->directory)) ||
+        spawn_child(window, vte, opts->directory, command_argv, info.spawn);
+    profile_phase("spawn");
+
+    if (opts->execute) {
+        g_strfreev(command_argv);
+    } else {
+        g_free(default_argv[0]);
+    }
+
+    if (!spawned) {
+        // a standalone terminal exits with a failure status from main instead
+        if (daemon_mode) {
+            gtk_widget_destroy(window);
+        }
+        return nullptr;
+    }
+
+    int width, height, padding_left, padding_top, padding_right, padding_bottom;
+    const long char_width = vte_terminal_get_char_width(vte);
+    const long char_height = vte_terminal_get_char_height(vte);
+
+    gtk_window_get_size(GTK_WINDOW(window), &width, &height);
+    get_vte_padding(vte, &padding_left, &padding_top, &padding_right, &padding_bottom);
+    vte_terminal_set_size(vte,
+                          (width - padding_left - padding_right) / char_width,
+                          (height - padding_top - padding_bottom) / char_height);
+
+    return win;
+}
+
+/* {{{ DAEMON */
+static std::string socket_path() {
+    return std::string(g_get_user_runtime_dir()) + "/termite/socket";
+}
+
+static GSocketConnection *connect_daemon() {
+    GSocketAddress *address = g_unix_socket_address_new(socket_path().c_str());
+    GSocketClient *client = g_socket_client_new();
+    GSocketConnection *connection =
+        g_socket_client_connect(client, G_SOCKET_CONNECTABLE(address), nullptr, nullptr);
+    g_object_unref(client);
+    g_object_unref(address);
+    return connection;
+}
+
+static bool send_window_request(const window_options *opts) {
+    GSocketConnection *connection = connect_daemon();
+    if (!connection) {
+        return false;
+    }
+
+    GKeyFile *request = g_key_file_new();
+    auto cwd = make_unique(g_get_current_dir(), g_free);
+    if (opts->directory) {
+        auto directory = make_unique(g_path_is_absolute(opts->directory) ?
+                                     g_strdup(opts->directory) :
+                                     g_build_filename(cwd.get(), opts->directory, nullptr),
+                                     g_free);
+        g_key_file_set_string(request, "window", "directory", directory.get());
+    } else {
+        g_key_file_set_string(request, "window", "directory", cwd.get());
+    }
+    if (opts->execute) {
+        g_key_file_set_string(request, "window", "exec", opts->execute);
+    }
+    if (opts->role) {
+        g_key_file_set_string(request, "window", "role", opts->role);
+    }
+    if (opts->title) {
+        g_key_file_set_string(request, "window", "title", opts->title);
+    }
+    if (opts->icon) {
+        g_key_file_set_string(request, "window", "icon", opts->icon);
+    }
+    g_key_file_set_boolean(request, "window", "hold", opts->hold);
+
+    gsize length;
+    auto data = make_unique(g_key_file_to_data(request, &length, nullptr), g_free);
+    g_key_file_free(request);
+
+    GError *error = nullptr;
+    GOutputStream *output = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+    const bool sent = g_output_stream_write_all(output, data.get(), length, nullptr, nullptr, &error);
+    if (!sent) {
+        g_printerr("failed to send request to daemon: %s\n", error->message);
         g_error_free(error);
-        return {};
     }
-    return value;
+    g_object_unref(connection);
+    return sent;
 }
 
-auto get_config_integer(std::bind(get_config<int>, g_key_file_get_integer,
-                                  _1, _2, _3));
-auto get_config_string(std::bind(get_config<char *>, g_key_file_get_string,
-                                 _1, _2, _3));
-auto get_config_double(std::bind(get_config<double>, g_key_file_get_double,
-                                 _1, _2, _3));
+static gboolean open_requested_window(window_options *opts) {
+    create_window(opts);
+    g_free(opts->directory);
+    g_free(opts->execute);
+    g_free(opts->role);
+    g_free(opts->title);
+    g_free(opts->icon);
+    delete opts;
+    return G_SOURCE_REMOVE;
+}
 
-static maybe<GdkRGBA> get_config_color(GKeyFile *config, const char *section, const char *key) {
-    if (auto s = get_config_string(config, section, key)) {
-        GdkRGBA color;
-        if (gdk_rgba_parse(&color, *s)) {
-            g_free(*s);
-            return color;
+// runs on a worker thread of the socket service, the window is created on the main loop
+static gboolean daemon_request_cb(GThreadedSocketService *, GSocketConnection *connection,
+                                  GObject *, void *) {
+    static const size_t max_request_size = 64 * 1024;
+    GInputStream *input = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+    std::string data;
+    char buffer[4096];
+    gssize n;
+
+    while ((n = g_input_stream_read(input, buffer, sizeof(buffer), nullptr, nullptr)) > 0) {
+        data.append(buffer, (size_t)n);
+        if (data.size() > max_request_size) {
+            g_printerr("window request too large\n");
+            return TRUE;
         }
-        g_printerr("invalid color string: %s\n", *s);
-        g_free(*s);
     }
-    return {};
+
+    GKeyFile *request = g_key_file_new();
+    GError *error = nullptr;
+    if (!g_key_file_load_from_data(request, data.c_str(), data.size(), G_KEY_FILE_NONE, &error)) {
+        g_printerr("invalid window request: %s\n", error->message);
+        g_error_free(error);
+        g_key_file_free(request);
+        return TRUE;
+    }
+
+    window_options *opts = new window_options {
+        get_config_string(request, "window", "directory").get_value_or(nullptr),
+        get_config_string(request, "window", "exec").get_value_or(nullptr),
+        get_config_string(request, "window", "role").get_value_or(nullptr),
+        get_config_string(request, "window", "title").get_value_or(nullptr),
+        get_config_string(request, "window", "icon").get_value_or(nullptr),
+        get_config<gboolean>(g_key_file_get_boolean, request, "window", "hold").get_value_or(FALSE)
+    };
+    g_key_file_free(request);
+
+    g_idle_add((GSourceFunc)open_requested_window, opts);
+    return TRUE;
 }
 
-static maybe<cairo_pattern_t *>
-get_config_cairo_color(GKeyFile *config, const char *group, const char *key) {
-    if (auto color = get_config_color(config, group, key)) {
-        return cairo_pattern_create_rgba(color->red,
-                                         color->green,
-                                         color->blue,
-                                         color->alpha);
+static bool start_daemon() {
+    const std::string path = socket_path();
+    auto dir = make_unique(g_path_get_dirname(path.c_str()), g_free);
+    if (g_mkdir_with_parents(dir.get(), 0700) == -1) {
+        perror("mkdir");
+        return false;
     }
-    return {};
+
+    if (GSocketConnection *connection = connect_daemon()) {
+        g_object_unref(connection);
+        g_printerr("a daemon is already listening on %s\n", path.c_str());
+        return false;
+    }
+    unlink(path.c_str()); // stale socket left behind by a daemon that didn't exit cleanly
+
+    GSocketService *service = g_threaded_socket_service_new(4);
+    GSocketAddress *address = g_unix_socket_address_new(path.c_str());
+    GError *error = nullptr;
+    const bool listening = g_socket_listener_add_address(G_SOCKET_LISTENER(service), address,
+                                                         G_SOCKET_TYPE_STREAM,
+                                                         G_SOCKET_PROTOCOL_DEFAULT,
+                                                         nullptr, nullptr, &error);
+    g_object_unref(address);
+    if (!listening) {
+        g_printerr("failed to listen on %s: %s\n", path.c_str(), error->message);
+        g_error_free(error);
+        g_object_unref(service);
+        return false;
+    }
+
+    g_signal_connect(service, "run", G_CALLBACK(daemon_request_cb), nullptr);
+    g_socket_service_start(service);
+    return true;
 }
+/* }}} */
 
-static void load_theme(GtkWindow *window, VteTerminal *vte, GKeyFile *config, hint_info &hints) {
-    std::array<GdkRGBA, 256> palette;
-    char color_key[] = "color000";
+/* {{{ BENCHMARK */
+static const size_t bench_chunk_size = 64 * 1024;
+
+struct bench_state {
+    keybind_info *info;
+    GMappedFile *file;
+    size_t offset;
+    gint64 start;
+    gint64 last_frame;
+    unsigned long frames, dropped;
+    bool finished;
+};
 
-    for (unsigned i = 0; i < palette.size(); i++) {
-        snprintf(color_key, sizeof(color_key), "color%u", i);
-        if (auto color = get_config_color(config, "colors", color_key)) {
-            palette[i] = *color;
-        } else if (i < 16) {
-            palette[i].blue = (((i & 4) ? 0xc000 : 0) + (i > 7 ? 0x3fff: 0)) / 65535.0;
-            palette[i].green = (((i & 2) ? 0xc000 : 0) + (i > 7 ? 0x3fff : 0)) / 65535.0;
-            palette[i].red = (((i & 1) ? 0xc000 : 0) + (i > 7 ? 0x3fff : 0)) / 65535.0;
-            palette[i].alpha = 0;
-        } else if (i < 232) {
-            const unsigned j = i - 16;
-            const unsigned r = j / 36, g = (j / 6) % 6, b = j % 6;
-            const unsigned red =   (r == 0) ? 0 : r * 40 + 55;
-            const unsigned green = (g == 0) ? 0 : g * 40 + 55;
-            const unsigned blue =  (b == 0) ? 0 : b * 40 + 55;
-            palette[i].red   = (red | red << 8) / 65535.0;
-            palette[i].green = (green | green << 8) / 65535.0;
-            palette[i].blue  = (blue | blue << 8) / 65535.0;
-            palette[i].alpha = 0;
-        } else if (i < 256) {
-            const unsigned shade = 8 + (i - 232) * 10;
-            palette[i].red = palette[i].green = palette[i].blue = (shade | shade << 8) / 65535.0;
-            palette[i].alpha = 0;
-        }
+static void report_bench(bench_state *bench) {
+    const double seconds = (double)(g_get_monotonic_time() - bench->start) / G_USEC_PER_SEC;
+    const size_t bytes = g_mapped_file_get_length(bench->file);
+    guint scrollback_lines;
+    g_object_get(bench->info->vte, "scrollback-lines", &scrollback_lines, nullptr);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    g_print("{\"bytes\": %zu, \"seconds\": %.6f, \"mb_per_second\": %.3f, "
+            "\"frames\": %lu, \"dropped_frames\": %lu, \"peak_rss_kb\": %ld, "
+            "\"clickable_url\": %s, \"scrollback_lines\": %u}\n",
+            bytes, seconds, (double)bytes / (1024 * 1024) / seconds,
+            bench->frames, bench->dropped, usage.ru_maxrss,
+            bench->info->config.clickable_url ? "true" : "false", scrollback_lines);
+}
+
+// Frames that came later than the refresh interval count the ones skipped in between as dropped.
+static void bench_after_paint_cb(GdkFrameClock *clock, bench_state *bench) {
+    const gint64 now = gdk_frame_clock_get_frame_time(clock);
+    gint64 refresh_interval;
+    gdk_frame_clock_get_refresh_info(clock, now, &refresh_interval, nullptr);
+    if (bench->last_frame && refresh_interval > 0) {
+        const gint64 elapsed = now - bench->last_frame + refresh_interval / 2;
+        const gint64 skipped = elapsed / refresh_interval - 1;
+        bench->dropped += (unsigned long)std::max(skipped, (gint64)0);
     }
+    bench->last_frame = now;
+    bench->frames++;
 
-    vte_terminal_set_colors(vte, nullptr, nullptr, palette.data(), palette.size());
-    if (auto color = get_config_color(config, "colors", "foreground")) {
-        vte_terminal_set_color_foreground(vte, &*color);
-        vte_terminal_set_color_bold(vte, &*color);
+    // the last chunk counts once it has been drawn
+    if (bench->finished) {
+        report_bench(bench);
+        quit_process(EXIT_SUCCESS);
     }
-    if (auto color = get_config_color(config, "colors", "foreground_bold")) {
-        vte_terminal_set_color_bold(vte, &*color);
+}
+
+// Runs below the redraw priority, so output is drawn at the rate the frame clock allows
+// while the rest of the time goes to parsing.
+static gboolean bench_feed_cb(bench_state *bench) {
+    const char *data = g_mapped_file_get_contents(bench->file);
+    const size_t length = std::min(bench_chunk_size,
+                                   g_mapped_file_get_length(bench->file) - bench->offset);
+    vte_terminal_feed(bench->info->vte, data + bench->offset, (gssize)length);
+    bench->offset += length;
+    if (bench->offset < g_mapped_file_get_length(bench->file)) {
+        return G_SOURCE_CONTINUE;
     }
-    if (auto color = get_config_color(config, "colors", "background")) {
-        vte_terminal_set_color_background(vte, &*color);
-        override_background_color(GTK_WIDGET(window), &*color);
+    bench->finished = true;
+    gtk_widget_queue_draw(GTK_WIDGET(bench->info->vte));
+    return G_SOURCE_REMOVE;
+}
+
+// Replay a recorded stream through the window's terminal, with every handler a normal window
+// has attached, and report the throughput as JSON.
+static bool start_bench(window_info *win, const char *path) {
+    GError *error = nullptr;
+    GMappedFile *file = g_mapped_file_new(path, FALSE, &error);
+    if (!file) {
+        g_printerr("failed to open benchmark input: %s\n", error->message);
+        g_error_free(error);
+        return false;
     }
-    if (auto color = get_config_color(config, "colors", "cursor")) {
-        vte_terminal_set_color_cursor(vte, &*color);
+    if (!g_mapped_file_get_length(file)) {
+        g_printerr("benchmark input is empty\n");
+        g_mapped_file_unref(file);
+        return false;
     }
-    if (auto color = get_config_color(config, "colors", "cursor_foreground")) {
-        vte_terminal_set_color_cursor_foreground(vte, &*color);
+
+    bench_state *bench = new bench_state{&win->keybind, file, 0, g_get_monotonic_time(),
+                                         0, 0, 0, false};
+    GdkFrameClock *clock = gtk_widget_get_frame_clock(GTK_WIDGET(win->keybind.window));
+    g_signal_connect(clock, "after-paint", G_CALLBACK(bench_after_paint_cb), bench);
+    g_idle_add((GSourceFunc)bench_feed_cb, bench);
+    return true;
+}
+/* }}} */
+
+/* {{{ RECORDING */
+#if VTE_CHECK_VERSION (0, 48, 0)
+static const size_t record_ring_size = 4 * 1024 * 1024;
+static const size_t record_read_size = 64 * 1024;
+static const size_t record_batch_lines = 256;
+
+struct record_header {
+    gint64 time;
+    uint32_t length;
+    char type; // 'o' for output, 'r' for a resize
+};
+
+// Lock free for a single producer, the relay thread, and a single consumer, the writer thread.
+struct record_ring {
+    std::vector<char> data;
+    std::atomic<size_t> head, tail;
+};
+
+// Follows the child turning bracketed paste on and off, which VTE doesn't expose. Only private
+// mode sequences and full resets are looked at.
+struct paste_mode_parser {
+    enum class state { ground, escape, csi, private_csi, other_csi } at;
+    unsigned param;
+    bool matched; // 2004 is among the parameters so far
+};
+
+// The child runs on a pty of its own, and a relay thread copies between it and the pty read by
+// the terminal, as VTE has no way to observe the output stream. The output is also appended to
+// a ring, which a writer thread encodes as asciicast v2 events and writes out in batches.
+struct recorder {
+    VteTerminal *vte;
+    VtePty *outer, *inner; // read by the terminal, and the child's
+    int outer_slave;
+    GThread *relay;
+    int drain[2]; // closing the write end has the relay finish with what is left to read
+    std::atomic<uint32_t> size; // columns and rows of the terminal
+    record_ring ring;
+    GMutex lock;
+    GCond wake;
+    std::atomic<bool> stopping;
+    GThread *writer;
+    std::atomic<bool> bracketed_paste;
+    paste_mode_parser parser; // only used by the relay
+    // only used by the writer
+    int fd;
+    gint64 start, written, last_sync, rotate;
+    unsigned rotated;
+    bool dirty, failed;
+    std::string carry; // an incomplete UTF-8 sequence at the end of the last output
+};
+
+static recorder *recording = nullptr;
+
+static void ring_copy(const record_ring &ring, size_t pos, char *dst, size_t length) {
+    const size_t mask = ring.data.size() - 1;
+    const size_t first = std::min(length, ring.data.size() - (pos & mask));
+    memcpy(dst, &ring.data[pos & mask], first);
+    memcpy(dst + first, &ring.data[0], length - first);
+}
+
+static void ring_store(record_ring &ring, size_t pos, const char *src, size_t length) {
+    const size_t mask = ring.data.size() - 1;
+    const size_t first = std::min(length, ring.data.size() - (pos & mask));
+    memcpy(&ring.data[pos & mask], src, first);
+    memcpy(&ring.data[0], src + first, length - first);
+}
+
+// Waits for the writer while the ring is full, so a stalled disk slows the child down rather
+// than losing output.
+static void push_record(recorder *rec, char type, const char *data, size_t length) {
+    record_ring &ring = rec->ring;
+    const record_header header{g_get_monotonic_time(), (uint32_t)length, type};
+    const size_t needed = sizeof(header) + length;
+    const size_t head = ring.head.load(std::memory_order_relaxed);
+    while (head + needed - ring.tail.load(std::memory_order_acquire) > ring.data.size()) {
+        g_usleep(1000);
     }
-    if (auto color = get_config_color(config, "colors", "highlight")) {
-        vte_terminal_set_color_highlight(vte, &*color);
+    ring_store(ring, head, reinterpret_cast<const char *>(&header), sizeof(header));
+    ring_store(ring, head + sizeof(header), data, length);
+    // sequentially consistent with the writer's checks, which would otherwise miss the wakeup
+    ring.head.store(head + needed);
+    if (ring.tail.load() == head) {
+        g_mutex_lock(&rec->lock);
+        g_cond_signal(&rec->wake);
+        g_mutex_unlock(&rec->lock);
     }
+}
 
-    if (auto s = get_config_string(config, "hints", "font")) {
-        hints.font = pango_font_description_from_string(*s);
-        g_free(*s);
+static void append_json_string(std::string *out, const char *text, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        const unsigned char c = static_cast<unsigned char>(text[i]);
+        if (c == '"' || c == '\\') {
+            out->push_back('\\');
+            out->push_back((char)c);
+        } else if (c == '\n') {
+            out->append("\\n");
+        } else if (c == '\r') {
+            out->append("\\r");
+        } else if (c < 0x20 || c == 0x7f) {
+            char escape[7];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out->append(escape);
+        } else {
+            out->push_back((char)c);
+        }
     }
+}
 
-    hints.fg = get_config_cairo_color(config, "hints", "foreground").get_value_or(cairo_pattern_create_rgb(1, 1, 1));
-    hints.bg = get_config_cairo_color(config, "hints", "background").get_value_or(cairo_pattern_create_rgb(0, 0, 0));
-    hints.af = get_config_cairo_color(config, "hints", "active_foreground").get_value_or(cairo_pattern_create_rgb(0.9, 0.5, 0.5));
-    hints.ab = get_config_cairo_color(config, "hints", "active_background").get_value_or(cairo_pattern_create_rgb(0, 0, 0));
-    hints.border = get_config_cairo_color(config, "hints", "border").get_value_or(hints.fg);
-    hints.padding = get_config_double(config, "hints", "padding", 5).get_value_or(2.0);
-    hints.border_width = get_config_double(config, "hints", "border_width").get_value_or(1.0);
-    hints.roundness = get_config_double(config, "hints", "roundness").get_value_or(1.5);
+// Invalid bytes become U+FFFD, while a sequence cut off by the end of a read is kept for the
+// next one.
+static void append_output(recorder *rec, std::string *out, const std::string &payload) {
+    const std::string data = rec->carry + payload;
+    rec->carry.clear();
+    const char *p = data.data(), *end = data.data() + data.size();
+    while (p < end) {
+        const char *valid_end;
+        g_utf8_validate(p, end - p, &valid_end);
+        append_json_string(out, p, (size_t)(valid_end - p));
+        p = valid_end;
+        if (p == end) {
+            break;
+        }
+        if (!*p) {
+            append_json_string(out, p++, 1); // valid, but ends the validation
+            continue;
+        }
+        if (g_utf8_get_char_validated(p, end - p) == (gunichar)-2) {
+            rec->carry.assign(p, end);
+            break;
+        }
+        out->append("\xef\xbf\xbd");
+        p++;
+    }
 }
 
-static void load_config(GtkWindow *window, VteTerminal *vte, GtkWidget *scrollbar,
-                        GtkWidget *hbox, config_info *info, char **icon,
-                        bool *show_scrollbar) {
-    const std::string default_path = "/termite/config";
-    GKeyFile *config = g_key_file_new();
-    GError *error = nullptr;
+static bool write_all_lines(recorder *rec, std::vector<std::string> &lines) {
+    std::vector<iovec> iov;
+    for (std::string &line : lines) {
+        iov.push_back({&line[0], line.size()});
+    }
+    size_t first = 0;
+    while (first < iov.size()) {
+        const int count = (int)std::min(iov.size() - first, (size_t)IOV_MAX);
+        const ssize_t n = writev(rec->fd, &iov[first], count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        rec->written += n;
+        for (size_t left = (size_t)n; left; ) {
+            const size_t taken = std::min(left, iov[first].iov_len);
+            iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + taken;
+            iov[first].iov_len -= taken;
+            left -= taken;
+            if (!iov[first].iov_len) {
+                first++;
+            }
+        }
+        while (first < iov.size() && !iov[first].iov_len) {
+            first++;
+        }
+    }
+    return true;
+}
 
-    gboolean loaded = FALSE;
+static std::string record_size_string(uint32_t size) {
+    return std::to_string(size >> 16) + "x" + std::to_string(size & 0xffff);
+}
 
-    if (info->config_file) {
-        loaded = g_key_file_load_from_file(config,
-                                           info->config_file,
-                                           G_KEY_FILE_NONE, &error);
-        if (!loaded)
-            g_printerr("%s parsing failed: %s\n", info->config_file,
-                       error->message);
+static bool open_recording_file(recorder *rec) {
+    rec->fd = open(record_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (rec->fd == -1) {
+        g_printerr("failed to open %s: %s\n", record_file, g_strerror(errno));
+        return false;
     }
-
-    if (!loaded) {
-        loaded = g_key_file_load_from_file(config,
-                                           (g_get_user_config_dir() + default_path).c_str(),
-                                           G_KEY_FILE_NONE, &error);
-        if (!loaded)
-            g_printerr("%s parsing failed: %s\n", (g_get_user_config_dir() + default_path).c_str(),
-                       error->message);
+    rec->start = rec->last_sync = g_get_monotonic_time();
+    rec->written = 0;
+
+    const uint32_t size = rec->size.load();
+    std::string header = "{\"version\": 2, \"width\": " + std::to_string(size >> 16) +
+        ", \"height\": " + std::to_string(size & 0xffff) +
+        ", \"timestamp\": " + std::to_string(g_get_real_time() / G_USEC_PER_SEC) +
+        ", \"env\": {\"TERM\": \"xterm-termite\", \"SHELL\": \"";
+    if (const char *shell = g_getenv("SHELL")) {
+        append_json_string(&header, shell, strlen(shell));
     }
+    header += "\"}}\n";
+    std::vector<std::string> lines{header};
+    return write_all_lines(rec, lines);
+}
 
-    for (const char *const *dir = g_get_system_config_dirs();
-         !loaded && *dir; dir++) {
-        loaded = g_key_file_load_from_file(config, (*dir + default_path).c_str(),
-                                           G_KEY_FILE_NONE, &error);
-        if (!loaded)
-            g_printerr("%s parsing failed: %s\n", (*dir + default_path).c_str(),
-                       error->message);
+static void sync_recording(recorder *rec) {
+    if (rec->dirty && record_fsync >= 0) {
+        fdatasync(rec->fd);
+        rec->last_sync = g_get_monotonic_time();
+        rec->dirty = false;
     }
+}
 
-    if (loaded) {
-        set_config(window, vte, scrollbar, hbox, info, icon, show_scrollbar, config);
+// Rotated files are numbered in the order they were written.
+static void rotate_recording(recorder *rec) {
+    sync_recording(rec);
+    close(rec->fd);
+    rec->fd = -1;
+    std::string rotated;
+    do {
+        rotated = std::string(record_file) + "." + std::to_string(++rec->rotated);
+    } while (g_file_test(rotated.c_str(), G_FILE_TEST_EXISTS));
+    if (rename(record_file, rotated.c_str()) == -1 || !open_recording_file(rec)) {
+        g_printerr("failed to rotate %s: %s\n", record_file, g_strerror(errno));
+        rec->failed = true;
     }
-    g_key_file_free(config);
 }
 
-static void set_config(GtkWindow *window, VteTerminal *vte, GtkWidget *scrollbar, GtkWidget *hbox,
-                       config_info *info, char **icon, bool *show_scrollbar_ptr,
-                       GKeyFile *config) {
-
-    auto cfg_bool = [config](const char *key, gboolean value) {
-        return get_config<gboolean>(g_key_file_get_boolean,
-                                    config, "options", key).get_value_or(value);
-    };
-
-    vte_terminal_set_scroll_on_output(vte, cfg_bool("scroll_on_output", FALSE));
-    vte_terminal_set_scroll_on_keystroke(vte, cfg_bool("scroll_on_keystroke", TRUE));
-    vte_terminal_set_audible_bell(vte, cfg_bool("audible_bell", FALSE));
-    vte_terminal_set_mouse_autohide(vte, cfg_bool("mouse_autohide", FALSE));
-    vte_terminal_set_allow_bold(vte, cfg_bool("allow_bold", TRUE));
-    vte_terminal_search_set_wrap_around(vte, cfg_bool("search_wrap", TRUE));
-#if VTE_CHECK_VERSION (0, 49, 1)
-    vte_terminal_set_allow_hyperlink(vte, cfg_bool("hyperlinks", FALSE));
-#endif
-#if VTE_CHECK_VERSION (0, 51, 2)
-    vte_terminal_set_bold_is_bright(vte, cfg_bool("bold_is_bright", TRUE));
-    vte_terminal_set_cell_height_scale(vte, get_config_double(config, "options", "cell_height_scale").get_value_or(1.0));
-    vte_terminal_set_cell_width_scale(vte, get_config_double(config, "options", "cell_width_scale").get_value_or(1.0));
-#endif
-    info->dynamic_title = cfg_bool("dynamic_title", TRUE);
-    info->urgent_on_bell = cfg_bool("urgent_on_bell", TRUE);
-    info->clickable_url = cfg_bool("clickable_url", TRUE);
-    info->size_hints = cfg_bool("size_hints", FALSE);
-    info->filter_unmatched_urls = cfg_bool("filter_unmatched_urls", TRUE);
-    info->modify_other_keys = cfg_bool("modify_other_keys", FALSE);
-    info->fullscreen = cfg_bool("fullscreen", TRUE);
-    info->font_scale = vte_terminal_get_font_scale(vte);
+static gpointer record_writer_thread(gpointer data) {
+    recorder *rec = static_cast<recorder *>(data);
+    record_ring &ring = rec->ring;
+    std::vector<std::string> lines;
+    std::string payload;
+
+    for (;;) {
+        // read before the ring, so nothing pushed before stopping is left behind
+        const bool stopping = rec->stopping.load();
+        const size_t head = ring.head.load(std::memory_order_acquire);
+        size_t tail = ring.tail.load(std::memory_order_relaxed);
+        if (head == tail) {
+            if (stopping) {
+                break;
+            }
+            g_mutex_lock(&rec->lock);
+            while (ring.head.load() == tail && !rec->stopping.load()) {
+                if (rec->dirty && record_fsync > 0) {
+                    const gint64 deadline = rec->last_sync + record_fsync * G_TIME_SPAN_SECOND;
+                    if (!g_cond_wait_until(&rec->wake, &rec->lock, deadline)) {
+                        sync_recording(rec);
+                    }
+                } else {
+                    g_cond_wait(&rec->wake, &rec->lock);
+                }
+            }
+            g_mutex_unlock(&rec->lock);
+            continue;
+        }
 
-    g_free(info->browser);
-    info->browser = nullptr;
+        while (tail != head && lines.size() < record_batch_lines) {
+            record_header header;
+            ring_copy(ring, tail, reinterpret_cast<char *>(&header), sizeof(header));
+            payload.resize(header.length);
+            ring_copy(ring, tail + sizeof(header), &payload[0], header.length);
+            tail += sizeof(header) + header.length;
+
+            char time[32];
+            snprintf(time, sizeof(time), "[%.6f, \"%c\", \"",
+                     (double)std::max(header.time - rec->start, (gint64)0) / G_USEC_PER_SEC,
+                     header.type);
+            std::string line(time);
+            if (header.type == 'o') {
+                append_output(rec, &line, payload);
+            } else {
+                line += payload;
+            }
+            line += "\"]\n";
+            lines.push_back(std::move(line));
+        }
+        ring.tail.store(tail);
 
-    if (auto s = get_config_string(config, "options", "browser")) {
-        info->browser = *s;
-    } else {
-        info->browser = g_strdup(g_getenv("BROWSER"));
+        // output is still drained after a failure, so the child never waits on the ring
+        if (!rec->failed) {
+            if (!write_all_lines(rec, lines)) {
+                g_printerr("failed to write %s: %s\n", record_file, g_strerror(errno));
+                rec->failed = true;
+            }
+            rec->dirty = true;
+            if (record_fsync == 0 ||
+                (record_fsync > 0 &&
+                 g_get_monotonic_time() - rec->last_sync >= record_fsync * G_TIME_SPAN_SECOND)) {
+                sync_recording(rec);
+            }
+            if (rec->rotate > 0 && rec->written >= rec->rotate) {
+                rotate_recording(rec);
+            }
+        }
+        lines.clear();
     }
 
-    if (!info->browser) {
-        info->browser = g_strdup("xdg-open");
+    if (!rec->failed) {
+        sync_recording(rec);
     }
-
-    if (info->clickable_url) {
-        info->tag = vte_terminal_match_add_regex(vte,
-                vte_regex_new_for_match(url_regex,
-                                        (gssize) strlen(url_regex),
-                                        PCRE2_MULTILINE | PCRE2_NOTEMPTY,
-                                        nullptr),
-                0);
-        vte_terminal_match_set_cursor_name(vte, info->tag, "hand");
-    } else if (info->tag != -1) {
-        vte_terminal_match_remove(vte, info->tag);
-        info->tag = -1;
+    if (rec->fd != -1) {
+        close(rec->fd);
     }
+    return nullptr;
+}
 
-    if (auto s = get_config_string(config, "options", "font")) {
-        PangoFontDescription *font = pango_font_description_from_string(*s);
-        vte_terminal_set_font(vte, font);
-        pango_font_description_free(font);
-        g_free(*s);
+static void follow_paste_mode(recorder *rec, const char *data, size_t length) {
+    using state = paste_mode_parser::state;
+    paste_mode_parser &parser = rec->parser;
+    for (size_t i = 0; i < length; i++) {
+        const char c = data[i];
+        const bool final_byte = c >= 0x40 && c <= 0x7e;
+        if (c == '\033') {
+            parser.at = state::escape;
+            continue;
+        }
+        switch (parser.at) {
+            case state::ground:
+                break;
+            case state::escape:
+                if (c == 'c') {
+                    rec->bracketed_paste = false;
+                }
+                parser.at = c == '[' ? state::csi : state::ground;
+                break;
+            case state::csi:
+                if (c == '?') {
+                    parser.at = state::private_csi;
+                    parser.param = 0;
+                    parser.matched = false;
+                } else {
+                    parser.at = final_byte ? state::ground : state::other_csi;
+                }
+                break;
+            case state::private_csi:
+                if (c >= '0' && c <= '9') {
+                    parser.param = std::min(parser.param * 10 + (unsigned)(c - '0'), 100000u);
+                } else if (c == ';' || c == 'h' || c == 'l') {
+                    parser.matched = parser.matched || parser.param == 2004;
+                    parser.param = 0;
+                    if (c != ';') {
+                        if (parser.matched) {
+                            rec->bracketed_paste = c == 'h';
+                        }
+                        parser.at = state::ground;
+                    }
+                } else {
+                    parser.at = final_byte ? state::ground : state::other_csi;
+                }
+                break;
+            case state::other_csi:
+                if (final_byte) {
+                    parser.at = state::ground;
+                }
+                break;
+        }
     }
+}
 
-    if (auto i = get_config_integer(config, "options", "scrollback_lines")) {
-        vte_terminal_set_scrollback_lines(vte, *i);
+#if VTE_CHECK_VERSION(0, 68, 0)
+static bool recorded_paste_mode(VteTerminal *vte, bool *bracketed) {
+    if (!recording || recording->vte != vte) {
+        return false;
     }
+    *bracketed = recording->bracketed_paste.load();
+    return true;
+}
 
-    if (auto s = get_config_string(config, "options", "cursor_blink")) {
-        if (!g_ascii_strcasecmp(*s, "system")) {
-            vte_terminal_set_cursor_blink_mode(vte, VTE_CURSOR_BLINK_SYSTEM);
-        } else if (!g_ascii_strcasecmp(*s, "on")) {
-            vte_terminal_set_cursor_blink_mode(vte, VTE_CURSOR_BLINK_ON);
-        } else if (!g_ascii_strcasecmp(*s, "off")) {
-            vte_terminal_set_cursor_blink_mode(vte, VTE_CURSOR_BLINK_OFF);
-        }
-        g_free(*s);
+static void reset_recorded_paste_mode(VteTerminal *vte) {
+    if (recording && recording->vte == vte) {
+        recording->bracketed_paste = false;
     }
+}
+#endif
 
-    if (auto s = get_config_string(config, "options", "cursor_shape")) {
-        if (!g_ascii_strcasecmp(*s, "block")) {
-            vte_terminal_set_cursor_shape(vte, VTE_CURSOR_SHAPE_BLOCK);
-        } else if (!g_ascii_strcasecmp(*s, "ibeam")) {
-            vte_terminal_set_cursor_shape(vte, VTE_CURSOR_SHAPE_IBEAM);
-        } else if (!g_ascii_strcasecmp(*s, "underline")) {
-            vte_terminal_set_cursor_shape(vte, VTE_CURSOR_SHAPE_UNDERLINE);
-        }
-        g_free(*s);
+static bool write_some(int fd, std::string *pending) {
+    const ssize_t n = write(fd, pending->data(), pending->size());
+    if (n < 0) {
+        return errno == EAGAIN || errno == EINTR;
     }
+    pending->erase(0, (size_t)n);
+    return true;
+}
 
-    if (icon) {
-        if (auto s = get_config_string(config, "options", "icon_name")) {
-            *icon = *s;
+// Copies between the two ptys until the child's side is closed, holding back reads in a
+// direction while the other end has not taken the previous ones. When asked to drain, it stops
+// as soon as neither side is ready, rather than waiting for everything holding the child's pty
+// to close it.
+static gpointer record_relay_thread(gpointer data) {
+    recorder *rec = static_cast<recorder *>(data);
+    const int inner = vte_pty_get_fd(rec->inner);
+    const int outer = rec->outer_slave;
+    std::vector<char> buffer(record_read_size);
+    std::string output, input; // to the terminal, and to the child
+    uint32_t size = 0;
+    bool draining = false;
+
+    for (;;) {
+        pollfd fds[3] = {
+            {inner, (short)((output.empty() ? POLLIN : 0) | (input.empty() ? 0 : POLLOUT)), 0},
+            {outer, (short)((input.empty() ? POLLIN : 0) | (output.empty() ? 0 : POLLOUT)), 0},
+            {rec->drain[0], POLLIN, 0}
+        };
+        const int ready = poll(fds, draining ? 2 : 3, draining ? 0 : -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (!ready) {
+            break;
+        }
+        if (!draining && fds[2].revents) {
+            draining = true;
+            continue;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR) && output.empty()) {
+            const ssize_t n = read(inner, buffer.data(), buffer.size());
+            if (n <= 0 && !(n < 0 && (errno == EAGAIN || errno == EINTR))) {
+                break; // the child and everything it started have closed the pty
+            }
+            if (n > 0) {
+                if (rec->size.load() != size) {
+                    size = rec->size.load();
+                    const std::string resize = record_size_string(size);
+                    push_record(rec, 'r', resize.data(), resize.size());
+                }
+                push_record(rec, 'o', buffer.data(), (size_t)n);
+                follow_paste_mode(rec, buffer.data(), (size_t)n);
+                output.assign(buffer.data(), (size_t)n);
+            }
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR) && input.empty()) {
+            const ssize_t n = read(outer, buffer.data(), buffer.size());
+            if (n <= 0 && !(n < 0 && (errno == EAGAIN || errno == EINTR))) {
+                break; // the terminal is gone
+            }
+            if (n > 0) {
+                input.assign(buffer.data(), (size_t)n);
+            }
+        }
+        if ((!output.empty() && !write_some(outer, &output)) ||
+            (!input.empty() && !write_some(inner, &input))) {
+            break;
         }
     }
 
-    if (info->size_hints) {
-        set_size_hints(GTK_WINDOW(window), vte);
+    // blocking for what is left, the terminal only sees the end of the output once it is closed
+    if (!draining) {
+        g_unix_set_fd_nonblocking(outer, FALSE, nullptr);
+        while (!output.empty() && write_some(outer, &output)) {}
     }
+    close(outer);
+    return nullptr;
+}
 
-    bool show_scrollbar = false;
-    if (auto s = get_config_string(config, "options", "scrollbar")) {
-        // "off" is implicitly handled by default
-        if (!g_ascii_strcasecmp(*s, "left")) {
-            show_scrollbar = true;
-            gtk_box_reorder_child(GTK_BOX(hbox), scrollbar, 0);
-        } else if (!g_ascii_strcasecmp(*s, "right")) {
-            show_scrollbar = true;
-            gtk_box_reorder_child(GTK_BOX(hbox), scrollbar, -1);
-        }
-        g_free(*s);
-    }
-    if (show_scrollbar) {
-        gtk_widget_show(scrollbar);
-    } else {
-        gtk_widget_hide(scrollbar);
-    }
-    if (show_scrollbar_ptr != nullptr) {
-        *show_scrollbar_ptr = show_scrollbar;
+static void record_size_cb(VteTerminal *vte, GdkRectangle *, recorder *rec) {
+    const uint32_t size = (uint32_t)vte_terminal_get_column_count(vte) << 16 |
+                          (uint32_t)vte_terminal_get_row_count(vte);
+    if (size != rec->size.load()) {
+        vte_pty_set_size(rec->inner, (int)(size & 0xffff), (int)(size >> 16), nullptr);
+        rec->size.store(size);
     }
-
-    load_theme(window, vte, config, info->hints);
-}/*}}}*/
-
-static void exit_with_status(VteTerminal *, int status) {
-    gtk_main_quit();
-    exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
 }
 
-static void exit_with_success(VteTerminal *) {
-    gtk_main_quit();
-    exit(EXIT_SUCCESS);
+static void recorded_spawn_cb(GObject *, GAsyncResult *result, gpointer data) {
+    VteTerminal *vte = VTE_TERMINAL(data);
+    GError *error = nullptr;
+    GPid pid;
+    if (!vte_pty_spawn_finish(recording->inner, result, &pid, &error)) {
+        spawn_failed(vte, error);
+        g_error_free(error);
+        return;
+    }
+    vte_terminal_watch_child(vte, pid);
+    // started once the child holds its side of the pty, which reads as closed until then
+    recording->relay = g_thread_new("record-relay", record_relay_thread, recording);
 }
 
-static char *get_user_shell_with_fallback() {
-    if (const char *env = g_getenv("SHELL") ) {
-        if (!((env != NULL) && (env[0] == '\0')))
-            return g_strdup(env);
+// Run at exit, after the child is gone. The relay records the last of its output before the
+// writer is stopped, which flushes the ring and closes the file.
+static void stop_recording() {
+    recorder *rec = recording;
+    close(rec->drain[1]);
+    rec->drain[1] = -1;
+    if (rec->relay) {
+        g_thread_join(rec->relay);
+        rec->relay = nullptr;
     }
+    g_mutex_lock(&rec->lock);
+    rec->stopping = true;
+    g_cond_signal(&rec->wake);
+    g_mutex_unlock(&rec->lock);
+    g_thread_join(rec->writer);
+}
 
-    if (char *command = vte_get_user_shell()) {
-        if (!((command != NULL) && (command[0] == '\0')))
-           return command;
+// for a recording that failed to start
+static void free_recorder(recorder *rec) {
+    for (int fd : {rec->outer_slave, rec->fd, rec->drain[0], rec->drain[1]}) {
+        if (fd != -1) {
+            close(fd);
+        }
     }
-
-    return g_strdup("/bin/sh");
+    if (rec->outer) {
+        g_object_unref(rec->outer);
+    }
+    if (rec->inner) {
+        g_object_unref(rec->inner);
+    }
+    g_mutex_clear(&rec->lock);
+    g_cond_clear(&rec->wake);
+    delete rec;
 }
 
-static void on_alpha_screen_changed(GtkWindow *window, GdkScreen *, void *) {
-    GdkScreen *screen = gtk_widget_get_screen(GTK_WIDGET(window));
-    GdkVisual *visual = gdk_screen_get_rgba_visual(screen);
+bool start_recording(VteTerminal *vte, const char *directory, char **argv, char **env) {
+    recorder *rec = new recorder();
+    rec->vte = vte;
+    rec->outer_slave = rec->fd = rec->drain[0] = rec->drain[1] = -1;
+    rec->ring.data.resize(record_ring_size);
+    rec->rotate = record_rotate ? parse_size(record_rotate) : 0;
+    rec->size = (uint32_t)vte_terminal_get_column_count(vte) << 16 |
+                (uint32_t)vte_terminal_get_row_count(vte);
+    g_mutex_init(&rec->lock);
+    g_cond_init(&rec->wake);
 
-    if (!visual)
-        visual = gdk_screen_get_system_visual(screen);
+    GError *error = nullptr;
+    rec->outer = vte_pty_new_sync(VTE_PTY_DEFAULT, nullptr, &error);
+    rec->inner = rec->outer ? vte_pty_new_sync(VTE_PTY_DEFAULT, nullptr, &error) : nullptr;
+    if (!rec->inner) {
+        g_printerr("failed to open a pty: %s\n", error->message);
+        g_error_free(error);
+        free_recorder(rec);
+        return false;
+    }
+    if (!g_unix_open_pipe(rec->drain, FD_CLOEXEC, &error)) {
+        g_printerr("failed to open a pipe: %s\n", error->message);
+        g_error_free(error);
+        free_recorder(rec);
+        return false;
+    }
+    rec->outer_slave = open(ptsname(vte_pty_get_fd(rec->outer)), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (rec->outer_slave == -1) {
+        g_printerr("failed to open the pty: %s\n", g_strerror(errno));
+    }
+    if (rec->outer_slave == -1 || !open_recording_file(rec)) {
+        free_recorder(rec);
+        return false;
+    }
 
-    gtk_widget_set_visual(GTK_WIDGET(window), visual);
+    // the line discipline of the child's pty already applies, the relayed bytes pass unchanged
+    termios attrs;
+    tcgetattr(rec->outer_slave, &attrs);
+    cfmakeraw(&attrs);
+    tcsetattr(rec->outer_slave, TCSANOW, &attrs);
+    g_unix_set_fd_nonblocking(rec->outer_slave, TRUE, nullptr);
+    g_unix_set_fd_nonblocking(vte_pty_get_fd(rec->inner), TRUE, nullptr);
+    vte_pty_set_size(rec->inner, (int)(rec->size & 0xffff), (int)(rec->size >> 16), nullptr);
+
+    vte_terminal_set_pty(vte, rec->outer);
+    g_signal_connect_after(vte, "size-allocate", G_CALLBACK(record_size_cb), rec);
+    recording = rec;
+    rec->writer = g_thread_new("record-writer", record_writer_thread, rec);
+    atexit(stop_recording);
+
+    vte_pty_spawn_async(rec->inner, directory, argv, env, G_SPAWN_SEARCH_PATH, nullptr, nullptr,
+                        nullptr, -1, nullptr, recorded_spawn_cb, vte);
+    return true;
 }
+#endif
+/* }}} */
 
 int main(int argc, char **argv) {
+    startup_time = startup_mark = g_get_monotonic_time();
     GError *error = nullptr;
-    const char *const term = "xterm-termite";
     char *directory = nullptr;
-    gboolean version = FALSE, hold = FALSE;
+    gboolean version = FALSE, hold = FALSE, run_daemon = FALSE, client = FALSE;
 
     GOptionContext *context = g_option_context_new(nullptr);
-    char *role = nullptr, *execute = nullptr, *config_file = nullptr;
+    char *role = nullptr, *execute = nullptr;
     char *title = nullptr, *icon = nullptr;
-    bool show_scrollbar = false;
     const GOptionEntry entries[] = {
         {"version", 'v', 0, G_OPTION_ARG_NONE, &version, "Version info", nullptr},
         {"exec", 'e', 0, G_OPTION_ARG_STRING, &execute, "Command to execute", "COMMAND"},
@@ -1653,12 +5762,21 @@ int main(int argc, char **argv) {
         {"title", 't', 0, G_OPTION_ARG_STRING, &title, "Window title", "TITLE"},
         {"directory", 'd', 0, G_OPTION_ARG_STRING, &directory, "Change to directory", "DIRECTORY"},
         {"hold", 0, 0, G_OPTION_ARG_NONE, &hold, "Remain open after child process exits", nullptr},
-        {"config", 'c', 0, G_OPTION_ARG_STRING, &config_file, "Path of config file", "CONFIG"},
+        {"config", 'c', 0, G_OPTION_ARG_STRING, &config_path, "Path of config file", "CONFIG"},
         {"icon", 'i', 0, G_OPTION_ARG_STRING, &icon, "Icon", "ICON"},
+        {"daemon", 0, 0, G_OPTION_ARG_NONE, &run_daemon, "Serve new windows to clients from one process", nullptr},
+        {"client", 0, 0, G_OPTION_ARG_NONE, &client, "Open the window in a running daemon", nullptr},
+        {"stats-file", 0, 0, G_OPTION_ARG_FILENAME, &stats_file, "Write input latency statistics to FILE", "FILE"},
+        {"startup-profile", 0, 0, G_OPTION_ARG_NONE, &startup_profile, "Print the time spent in each startup phase", nullptr},
+        {"bench", 0, 0, G_OPTION_ARG_FILENAME, &bench_file, "Replay a recorded stream and report throughput", "FILE"},
+        {"record", 0, 0, G_OPTION_ARG_FILENAME, &record_file, "Record the session to FILE in asciicast format", "FILE"},
+        {"record-fsync", 0, 0, G_OPTION_ARG_INT, &record_fsync, "Sync the recording every SECONDS, 0 after every write", "SECONDS"},
+        {"record-rotate", 0, 0, G_OPTION_ARG_STRING, &record_rotate, "Start a new recording file past SIZE", "SIZE"},
         {nullptr, 0, 0, G_OPTION_ARG_NONE, nullptr, nullptr, nullptr}
     };
     g_option_context_add_main_entries(context, entries, nullptr);
-    g_option_context_add_group(context, gtk_get_option_group(TRUE));
+    // the display is opened later, a client handing off to the daemon never needs one
+    g_option_context_add_group(context, gtk_get_option_group(FALSE));
 
     if (!g_option_context_parse(context, &argc, &argv, &error)) {
         g_printerr("option parsing failed: %s\n", error->message);
@@ -1667,187 +5785,71 @@ int main(int argc, char **argv) {
     }
 
     g_option_context_free(context);
+    profile_phase("options");
 
     if (version) {
         g_print("termite %s\n", TERMITE_VERSION);
         return EXIT_SUCCESS;
     }
 
-    if (directory) {
-        if (chdir(directory) == -1) {
-            perror("chdir");
-            return EXIT_FAILURE;
-        }
-        g_free(directory);
-    }
-
-    GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-
-    GtkWidget *panel_overlay = gtk_overlay_new();
-    GtkWidget *hint_overlay = gtk_overlay_new();
-
-    GtkWidget *vte_widget = vte_terminal_new();
-    VteTerminal *vte = VTE_TERMINAL(vte_widget);
-
-    GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
-    gtk_style_context_add_class(gtk_widget_get_style_context(hbox),"termite");
-    GtkWidget *scrollbar = gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(vte_widget)));
-    gtk_box_pack_start(GTK_BOX(hbox), hint_overlay, TRUE, TRUE, 0);
-    gtk_box_pack_start(GTK_BOX(hbox), scrollbar, FALSE, FALSE, 0);
-
-    if (role) {
-        gtk_window_set_role(GTK_WINDOW(window), role);
-        g_free(role);
-    }
-
-    char **command_argv;
-    char *default_argv[2] = {nullptr, nullptr};
-
-    if (execute) {
-        int argcp;
-        char **argvp;
-        g_shell_parse_argv(execute, &argcp, &argvp, &error);
-        if (error) {
-            g_printerr("failed to parse command: %s\n", error->message);
-            return EXIT_FAILURE;
-        }
-        command_argv = argvp;
-    } else {
-        default_argv[0] = get_user_shell_with_fallback();
-        command_argv = default_argv;
+    if (bench_file && (client || run_daemon)) {
+        g_printerr("--bench runs a standalone terminal\n");
+        return EXIT_FAILURE;
     }
 
-    keybind_info info {
-        GTK_WINDOW(window), vte,
-        {gtk_entry_new(),
-         gtk_drawing_area_new(),
-         overlay_mode::hidden,
-         std::vector<url_data>(),
-         nullptr},
-        {vi_mode::insert, 0, 0, 0, 0},
-        {{nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, 0, 0, 0},
-         nullptr, FALSE, FALSE, FALSE, FALSE, TRUE, FALSE, FALSE, -1, config_file, 0},
-        gtk_window_fullscreen
-    };
-
-    load_config(GTK_WINDOW(window), vte, scrollbar, hbox, &info.config,
-                icon ? nullptr : &icon, &show_scrollbar);
-
-    reload_config = [&]{
-        load_config(GTK_WINDOW(window), vte, scrollbar, hbox, &info.config,
-                    nullptr, nullptr);
-    };
-    signal(SIGUSR1, [](int){ reload_config(); });
-
-    GdkRGBA transparent {0, 0, 0, 0};
-
-    override_background_color(hint_overlay, &transparent);
-    override_background_color(info.panel.da, &transparent);
-
-    gtk_widget_set_halign(info.panel.da, GTK_ALIGN_FILL);
-    gtk_widget_set_valign(info.panel.da, GTK_ALIGN_FILL);
-    gtk_overlay_add_overlay(GTK_OVERLAY(hint_overlay), info.panel.da);
-
-    gtk_widget_set_margin_start(info.panel.entry, 5);
-    gtk_widget_set_margin_end(info.panel.entry, 5);
-    gtk_widget_set_margin_top(info.panel.entry, 5);
-    gtk_widget_set_margin_bottom(info.panel.entry, 5);
-    gtk_overlay_add_overlay(GTK_OVERLAY(panel_overlay), info.panel.entry);
-
-    gtk_widget_set_halign(info.panel.entry, GTK_ALIGN_START);
-    gtk_widget_set_valign(info.panel.entry, GTK_ALIGN_END);
-
-    gtk_container_add(GTK_CONTAINER(panel_overlay), hbox);
-    gtk_container_add(GTK_CONTAINER(hint_overlay), vte_widget);
-    gtk_container_add(GTK_CONTAINER(window), panel_overlay);
-
-    if (!hold) {
-        g_signal_connect(vte, "child-exited", G_CALLBACK(exit_with_status), nullptr);
+    if (record_file && (client || run_daemon || bench_file)) {
+        g_printerr("--record runs a standalone terminal\n");
+        return EXIT_FAILURE;
     }
-    g_signal_connect(window, "destroy", G_CALLBACK(exit_with_success), nullptr);
-    g_signal_connect(vte, "key-press-event", G_CALLBACK(key_press_cb), &info);
-    g_signal_connect(info.panel.entry, "key-press-event", G_CALLBACK(entry_key_press_cb), &info);
-    g_signal_connect(panel_overlay, "get-child-position", G_CALLBACK(position_overlay_cb), nullptr);
-    g_signal_connect(vte, "button-press-event", G_CALLBACK(button_press_cb), &info.config);
-    g_signal_connect(vte, "bell", G_CALLBACK(bell_cb), &info.config.urgent_on_bell);
-    draw_cb_info draw_cb_info{vte, &info.panel, &info.config.hints, info.config.filter_unmatched_urls};
-    g_signal_connect_swapped(info.panel.da, "draw", G_CALLBACK(draw_cb), &draw_cb_info);
-
-    g_signal_connect(window, "focus-in-event",  G_CALLBACK(focus_cb), nullptr);
-    g_signal_connect(window, "focus-out-event", G_CALLBACK(focus_cb), nullptr);
-
-    on_alpha_screen_changed(GTK_WINDOW(window), nullptr, nullptr);
-    g_signal_connect(window, "screen-changed", G_CALLBACK(on_alpha_screen_changed), nullptr);
-
-    if (info.config.fullscreen) {
-        g_signal_connect(window, "window-state-event", G_CALLBACK(window_state_cb), &info);
+#if !VTE_CHECK_VERSION (0, 48, 0)
+    if (record_file) {
+        g_printerr("--record requires vte 0.48\n");
+        return EXIT_FAILURE;
     }
+#endif
 
-    if (title) {
-        info.config.dynamic_title = FALSE;
-        gtk_window_set_title(GTK_WINDOW(window), title);
-        g_free(title);
-    } else {
-        g_signal_connect(vte, "window-title-changed", G_CALLBACK(window_title_cb),
-                         &info.config.dynamic_title);
-        if (execute) {
-            gtk_window_set_title(GTK_WINDOW(window), execute);
-        } else {
-            window_title_cb(vte, &info.config.dynamic_title);
+    if (client) {
+        window_options opts{directory, execute, role, title, icon, hold};
+        if (send_window_request(&opts)) {
+            return EXIT_SUCCESS;
         }
+        g_printerr("no daemon running, starting a standalone terminal\n");
     }
 
-    if (icon) {
-        gtk_window_set_icon_name(GTK_WINDOW(window), icon);
-        g_free(icon);
+    if (!open_display()) {
+        return EXIT_FAILURE;
     }
+    profile_phase("display");
 
-    gtk_widget_grab_focus(vte_widget);
-    gtk_widget_show_all(window);
-    gtk_widget_hide(info.panel.entry);
-    gtk_widget_hide(info.panel.da);
-    if (!show_scrollbar) {
-        gtk_widget_hide(scrollbar);
+    if (run_daemon) {
+        daemon_mode = true;
+        resident_config = read_config(config_path);
+        profile_phase("config lookup");
+        if (!start_daemon()) {
+            return EXIT_FAILURE;
+        }
+        resize_warm_pool();
+        setup_config_reload();
+        setup_latency_stats();
+        gtk_main();
+        return EXIT_SUCCESS;
     }
 
-    char **env = g_get_environ();
-
-#ifdef GDK_WINDOWING_X11
-    if (GDK_IS_X11_SCREEN(gtk_widget_get_screen(window))) {
-        GdkWindow *gdk_window = gtk_widget_get_window(window);
-        if (!gdk_window) {
-            g_printerr("no window\n");
+    if (directory) {
+        if (chdir(directory) == -1) {
+            perror("chdir");
             return EXIT_FAILURE;
         }
-        char xid_s[std::numeric_limits<long unsigned>::digits10 + 1];
-        snprintf(xid_s, sizeof(xid_s), "%lu", GDK_WINDOW_XID(gdk_window));
-        env = g_environ_setenv(env, "WINDOWID", xid_s, TRUE);
+        g_free(directory);
     }
-#endif
-
-    env = g_environ_setenv(env, "TERM", term, TRUE);
 
-    GPid child_pid;
-    if (vte_terminal_spawn_sync(vte, VTE_PTY_DEFAULT, nullptr, command_argv, env,
-                                G_SPAWN_SEARCH_PATH, nullptr, nullptr, &child_pid, nullptr,
-                                &error)) {
-        vte_terminal_watch_child(vte, child_pid);
-    } else {
-        g_printerr("the command failed to run: %s\n", error->message);
+    window_options opts{nullptr, execute, role, title, icon, hold};
+    window_info *win = create_window(&opts);
+    if (!win || (bench_file && !start_bench(win, bench_file))) {
         return EXIT_FAILURE;
     }
-
-    int width, height, padding_left, padding_top, padding_right, padding_bottom;
-    const long char_width = vte_terminal_get_char_width(vte);
-    const long char_height = vte_terminal_get_char_height(vte);
-
-    gtk_window_get_size(GTK_WINDOW(window), &width, &height);
-    get_vte_padding(vte, &padding_left, &padding_top, &padding_right, &padding_bottom);
-    vte_terminal_set_size(vte,
-                          (width - padding_left - padding_right) / char_width,
-                          (height - padding_top - padding_bottom) / char_height);
-
-    g_strfreev(env);
+    setup_config_reload();
+    setup_latency_stats();
 
     gtk_main();
     return EXIT_FAILURE; // child process did not cause termination
@@ -0,0 +1,80 @@
+#include <cstdio>
+
+#include "../search_literals.hh"
+
+static int failures = 0;
+
+static void expect(const char *pattern, size_t max_offset, bool result,
+                   const std::vector<std::string> &expected) {
+    std::vector<std::string> literals;
+    if (required_literals(pattern, max_offset, &literals) != result || literals != expected) {
+        fprintf(stderr, "required_literals(\"%s\") returned:", pattern);
+        for (const std::string &literal : literals) {
+            fprintf(stderr, " \"%s\"", literal.c_str());
+        }
+        fputc('\n', stderr);
+        failures++;
+    }
+}
+
+static void expect(const char *pattern, const std::vector<std::string> &expected) {
+    expect(pattern, 64, true, expected);
+}
+
+int main() {
+    expect("FooBar", {"foobar"});
+    expect("foo bar", {"foo bar"});
+    expect("foo|bar", 64, false, {});
+    expect("(?x)foo bar", 64, false, {});
+    expect("colou?r", {"colo"});
+    expect("abcd*ef", {"abc"});
+
+    // escape operands are not literals
+    expect("\\x41bcd", {"bcd"});
+    expect("\\x{263a}abc", {"abc"});
+    expect("\\o{101}xyz", {"xyz"});
+    expect("\\012xyz", {"xyz"});
+    expect("\\cAxyz", {"xyz"});
+    expect("\\p{Lu}xyz", {"xyz"});
+    expect("\\pLxyz", {"xyz"});
+    expect("\\N{U+41}xyz", {"xyz"});
+    expect("abc\\bdef", {"abc", "def"});
+    expect("a\\.bc", {"a.bc"});
+    expect("\\Qa.b*c\\Edef", {"a.b*cdef"});
+
+    // the length of a backreference isn't known, so nothing after it is required
+    expect("(?<n>abc)\\k<n>def", {});
+    expect("(abc)\\g{1}def", {});
+    expect("(abc)\\g-1def", {});
+    expect("(abc)\\1def", {});
+    expect("xyz(abc)\\1def", {"xyz"});
+
+    // literals after unbounded repeats may be arbitrarily far from the start
+    expect("foo.*bar", {"foo"});
+    expect("foo\\d+bar", {"foo"});
+    expect("foo.{2,}bar", {"foo"});
+    expect("foo(a+)bar", {"foo"});
+    expect("foo.{2,5}bar", {"foo", "bar"});
+    expect("foo.{0,100}bar", {"foo"});
+    expect("ab{0}cde", {"cde"});
+    expect("ab{,3}cde", {"cde"});
+    expect("(foo|bar)baz", {"baz"});
+    expect("[abc]def", {"def"});
+    expect("[]a-z]def", {"def"});
+    expect("(?=abc)def", {"def"});
+    expect("(?#comment)abc", {"abc"});
+
+    // braces that aren't quantifiers are literals
+    expect("ab{cd", {"ab{cd"});
+    expect("ab{}c", {"ab{}c"});
+
+    // literals must start within max_offset characters
+    expect("abcdefghij", 5, true, {"abcde"});
+    expect(".......abcd", 8, true, {});
+
+    if (failures) {
+        fprintf(stderr, "%d failed\n", failures);
+        return 1;
+    }
+    return 0;
+}